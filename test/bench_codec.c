@@ -0,0 +1,86 @@
+// what decoding costs on this host: frames of runs as DL_T_RLE, a few
+// changed spots as DL_T_DELTA, and the same frames as DL_T_FRAME, through
+// dl_rx_poll() and dataLink_process()
+#include <time.h>
+#include "host.h"
+#include USER_C
+
+#define PACKETS 1000
+
+double now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+u32 rand_state = 99;
+
+u32 rand32() {
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+}
+
+// time the packets queued, per frame
+double drain_us() {
+  double start = now_ns();
+
+  do
+    dl_rx_poll();
+  while(dataLink_process() || host_rx_left() > 0);
+  return (now_ns() - start) / PACKETS / 1e3;
+}
+
+int main() {
+  static u8 frame[FRAME_PIXEL_BYTES], last[FRAME_PIXEL_BYTES];
+  static u8 payload[2 * FRAME_PIXEL_BYTES];
+  double rle, delta, whole;
+  u32 k, i, n, at, len, rleBytes = 0, deltaBytes = 0;
+  u16 id = 0;
+
+  host_reset();
+  host_rxIrqOff = 1;
+  setup();
+
+  // runs of 1 to 64 pixels
+  for(k = 0; k < PACKETS; k++) {
+    for(i = 0; i < dl_pixels; i += len) {
+      len = 1 + rand32() % 64;
+      for(n = 0; n < len * FB_LED_BYTES && i * FB_LED_BYTES + n < FRAME_PIXEL_BYTES; n++)
+        frame[i * FB_LED_BYTES + n] = (n < FB_LED_BYTES) ? rand32() : frame[i * FB_LED_BYTES + n - FB_LED_BYTES];
+    }
+    len = host_rle(payload, frame, dl_pixels, FB_LED_BYTES);
+    rleBytes += len;
+    host_send(DL_T_RLE, 0, id++, payload, len);
+  }
+  rle = drain_us();
+
+  // 8 spots of 16 pixels change, one packet at a time: the base has to be
+  // the newest frame
+  delta = 0;
+  memcpy(last, frame, sizeof(last));
+  for(k = 0; k < PACKETS; k++) {
+    for(n = 0; n < 8; n++) {
+      at = rand32() % (dl_pixels - 16);
+      for(i = 0; i < 16 * FB_LED_BYTES; i++)
+        frame[at * FB_LED_BYTES + i] = rand32();
+    }
+    len = host_delta(payload, id - 1, frame, last, dl_pixels, FB_LED_BYTES);
+    deltaBytes += len;
+    host_send(DL_T_DELTA, 0, id++, payload, len);
+    memcpy(last, frame, sizeof(last));
+    delta += drain_us();
+  }
+
+  for(k = 0; k < PACKETS; k++)
+    host_send(DL_T_FRAME, 0, id++, frame, sizeof(frame));
+  whole = drain_us();
+
+  if(dl_crcErrors != 0 || fb_received != 3 * PACKETS)
+    printf("%u frames, %u CRC errors\n", fb_received, dl_crcErrors);
+  printf("%u pixels of %u bytes, per frame:\n", dl_pixels, FB_LED_BYTES);
+  printf("DL_T_RLE:    %7.2f us, %5u bytes\n", rle, rleBytes / PACKETS);
+  printf("DL_T_DELTA:  %7.2f us, %5u bytes\n", delta, deltaBytes / PACKETS);
+  printf("DL_T_FRAME:  %7.2f us, %5u bytes\n", whole, FRAME_PIXEL_BYTES);
+  return 0;
+}
@@ -0,0 +1,54 @@
+// what the receive path costs per byte on this host: frame packets through
+// dl_rx_poll() and dataLink_process(), next to dl_crc_update() alone
+#include <time.h>
+#include "host.h"
+#include USER_C
+
+#define PACKETS 1000
+#define ROUNDS  10
+
+double now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+volatile u32 sink;
+
+int main() {
+  static u8 frame[FRAME_PIXEL_BYTES];
+  double start, total = 0, crc;
+  u32 r, k, bytes = 0;
+
+  host_reset();
+  host_rxIrqOff = 1;
+  setup();
+
+  for(r = 0; r < ROUNDS; r++) {
+    for(k = 0; k < PACKETS; k++) {
+      memset(frame, k, sizeof(frame));
+      host_send(DL_T_FRAME, 0, r * PACKETS + k, frame, sizeof(frame));
+      bytes += DL_HEADER + sizeof(frame) + DL_TRAILER;
+    }
+    start = now_ns();
+    while(host_rx_left() > 0) {
+      dl_rx_poll();
+      while(dataLink_process())
+        ;
+    }
+    total += now_ns() - start;
+  }
+  if(fb_received != ROUNDS * PACKETS || dl_crcErrors != 0)
+    printf("%u frames, %u CRC errors\n", fb_received, dl_crcErrors);
+
+  start = now_ns();
+  for(r = 0; r < ROUNDS * PACKETS; r++)
+    sink = dl_crc_update(0xFFFFFFFF, frame, sizeof(frame));
+  crc = (now_ns() - start) / ((double)ROUNDS * PACKETS * sizeof(frame));
+
+  printf("frame packets:  %6.2f ns per byte, %6.1f MB/s, %6.1f us per %u byte frame\n",
+         total / bytes, bytes * 1e3 / total, total / (ROUNDS * PACKETS) / 1e3, FRAME_PIXEL_BYTES);
+  printf("dl_crc_update:  %6.2f ns per byte, %.0f%% of it\n", crc, 100 * crc * bytes / total);
+  return 0;
+}
@@ -0,0 +1,67 @@
+// parallel soft SPI: what lwp_transpose8() and lwp_bit_planes() cost per
+// strip byte on this host, next to a plain bit loop
+#include <time.h>
+#include "host.h"
+#include USER_C
+
+#define ROUNDS 20000000
+
+double now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void transpose_bits(const u8 *in, u32 stride, u8 *out) {
+  u8 k, s;
+
+  for(k = 0; k < 8; k++) {
+    out[k] = 0;
+    for(s = 0; s < 8; s++)
+      out[k] |= ((in[s * stride] >> (7 - k)) & 1) << s;
+  }
+}
+
+volatile u8 sink;
+
+int main() {
+  u8 in[64], out[8];
+  u32 planes[8];
+  double start, kernel, bits, bitPlanes;
+  u32 r, i;
+
+  host_reset();
+  setup();
+  for(i = 0; i < sizeof(in); i++)
+    in[i] = i * 37;
+
+  start = now_ns();
+  for(r = 0; r < ROUNDS; r++) {
+    in[r & 7] = r;
+    lwp_transpose8(in, 1, out);
+    sink = out[r & 7];
+  }
+  kernel = (now_ns() - start) / ROUNDS;
+
+  start = now_ns();
+  for(r = 0; r < ROUNDS; r++) {
+    in[r & 7] = r;
+    transpose_bits(in, 1, out);
+    sink = out[r & 7];
+  }
+  bits = (now_ns() - start) / ROUNDS;
+
+  start = now_ns();
+  for(r = 0; r < ROUNDS / 4; r++) {
+    lwp_bit_planes(frame_buff[0], LWP_SEG_FIRST * 3 + r % LWP_STRIP_BYTES, planes);
+    sink = planes[r & 7];
+  }
+  bitPlanes = (now_ns() - start) / (ROUNDS / 4);
+
+  printf("lwp_transpose8:  %6.2f ns per 8 strip bytes, %5.2f ns per byte\n", kernel, kernel / 8);
+  printf("bit loop:        %6.2f ns per 8 strip bytes, %.1fx the kernel\n", bits, bits / kernel);
+  printf("lwp_bit_planes:  %6.2f ns for %d strips, %5.2f ns per strip byte\n",
+         bitPlanes, LWP_STRIPS, bitPlanes / LWP_STRIPS);
+  return 0;
+}
@@ -0,0 +1,13 @@
+// the device on a pseudo terminal, for host tools: prints the slave to open
+// and runs until it is killed
+#include "host.h"
+#include USER_C
+
+int main() {
+  host_reset();
+  setup();
+  printf("%s\n", host_pty_open());
+  fflush(stdout);
+  for(;;)
+    host_pty_loop();
+}
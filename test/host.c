@@ -0,0 +1,670 @@
+// Host build of user.c: the peripherals, see host.h
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+#include <system.c>
+#include <spi.c>
+#include <__cdc.c>
+#include <interrupt.c>
+
+// the handlers the user.c variant has
+void Tmr4Interrupt(void) __attribute__((weak));
+void Tmr5Interrupt(void) __attribute__((weak));
+void SPI2Interrupt(void) __attribute__((weak));
+void loop(void);
+
+#define HOST_REG_DEFINE(name) hostReg host_##name;
+HOST_REGS(HOST_REG_DEFINE)
+
+#define HOST_LAT_DEFINE(name) volatile u32 name, name##SET, name##CLR, name##INV;
+HOST_LAT_DEFINE(LATA) HOST_LAT_DEFINE(LATB) HOST_LAT_DEFINE(LATC) HOST_LAT_DEFINE(LATD)
+HOST_LAT_DEFINE(LATE) HOST_LAT_DEFINE(LATF) HOST_LAT_DEFINE(LATG)
+HOST_LAT_DEFINE(TRISB) HOST_LAT_DEFINE(TRISD) HOST_LAT_DEFINE(TRISE)
+HOST_LAT_DEFINE(PORTB)
+
+u8  portmask[128];
+u16 pinmask[128];
+u8  host_latPort[HOST_LAT_MAX];
+u32 host_latValue[HOST_LAT_MAX];
+u32 host_latWrites;
+
+// register bits the models look at
+#define SPI_ON      (1 << 15)
+#define SPI_ENHBUF  (1 << 16)
+#define SPI_STXISEL (3 << 2)
+#define SPI_SPITBF  (1 << 1)
+#define SPI_SPIRBF  (1 << 0)
+#define SPI_TX_BIT  (1 << (INT_SPI2_TX - 32))
+#define DMA_ON      (1 << 15)
+#define DMA_CHEN    (1 << 7)
+#define DMA_SIRQEN  (1 << 4)
+#define DMA_CHBCIF  (1 << 3)
+#define TMR_ON      (1 << 15)
+#define HOST_NONE   ((uintptr_t)-1)
+
+u32 host_cp0;
+u32 host_cp0Step;
+void (*host_cp0Hook)(void);
+u64 host_elapsed;		// counts since host_reset()
+
+u32 host_spiCounts;
+u8  host_spiOut[HOST_SPI_MAX];
+u32 host_spiBytes;
+u32 host_dmaBlocks;
+u32 host_spiIrqs;
+u8  host_rxIrqOff;
+
+u8  host_spiQueue[17];		// TX buffer, the head one is in the shift register
+u8  host_spiQueued;
+u32 host_spiStart;		// CP0 count the head byte started
+u8  host_spiShifted;		// a byte went out since the last write
+uintptr_t host_spiWrite = HOST_NONE;	// SPI2BUF, a byte user.c wrote
+
+u8  host_intOn[64];
+u8  host_intFlag[64];
+u32 host_t4Last, host_t5Last;
+
+u8  host_rxData[HOST_CDC_MAX];
+u32 host_rxLen, host_rxPos;
+u8  host_txData[HOST_CDC_MAX];
+u32 host_txLen, host_txPos;
+u32 host_txLatency;
+u32 host_txPuts;
+u32 host_txBusy;		// CDCTxService() calls left for the IN transfer
+char *host_txSrc;		// putUSBUSART() sends from here, it doesn't copy
+u8  host_txSrcLen;
+char host_text[256];
+int host_ptyFd = -1;		// master of the pseudo terminal, -1 without one
+u64 host_ptyStart;		// wall clock ns when it opened
+
+int host_failures;
+
+u32 GetCP0Count(void) {
+  u32 now = host_cp0;
+
+  host_cp0 += host_cp0Step;
+  host_elapsed += host_cp0Step;
+  if(host_cp0Hook)
+    host_cp0Hook();
+  return now;
+}
+
+u64 host_us(void) {
+  return host_elapsed / (HOST_CP0_HZ / 1000000);
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// registers
+//////////////////////////////////////////////////////////////////////////////////
+u8 host_spi_depth(void) {
+  // the TX buffer and the shift register
+  return ((host_SPI2CON.reg & SPI_ENHBUF) ? 16 : 1) + 1;
+}
+
+void host_spi_status(void) {
+  host_SPI2STAT.reg &= ~(uintptr_t)(SPI_SPITBF | SPI_SPIRBF);
+  if(host_spiQueued >= host_spi_depth())
+    host_SPI2STAT.reg |= SPI_SPITBF;
+  if(host_spiQueued == 0 && host_spiShifted)
+    host_SPI2STAT.reg |= SPI_SPIRBF;
+}
+
+void host_spi_push(u8 b) {
+  if(host_spiQueued >= host_spi_depth()) {
+    printf("host: SPI2BUF written while the TX buffer is full\n");
+    host_failures++;
+    return;
+  }
+  if(host_spiQueued == 0)
+    host_spiStart = host_cp0;
+  host_spiQueue[host_spiQueued++] = b;
+  host_spiShifted = 0;
+}
+
+// a byte user.c wrote to SPI2BUF goes to the TX buffer
+void host_spi_flush(void) {
+  if(host_spiWrite != HOST_NONE) {
+    host_spi_push(host_spiWrite);
+    host_spiWrite = HOST_NONE;
+  }
+}
+
+void host_spi_run(void);
+
+// pending writes to the register take effect, the SPI and DMA catch up
+void host_fold(hostReg *r) {
+  host_spi_flush();
+  r->reg |= r->set;
+  r->reg &= ~r->clr;
+  r->reg ^= r->inv;
+  r->set = 0;
+  r->clr = 0;
+  r->inv = 0;
+  host_spi_run();
+  host_spi_status();
+}
+
+volatile uintptr_t *host_reg(hostReg *r) {
+  host_fold(r);
+  return &r->reg;
+}
+
+volatile uintptr_t *host_set(hostReg *r) {
+  host_fold(r);
+  return &r->set;
+}
+
+volatile uintptr_t *host_clr(hostReg *r) {
+  host_fold(r);
+  return &r->clr;
+}
+
+volatile uintptr_t *host_inv(hostReg *r) {
+  host_fold(r);
+  return &r->inv;
+}
+
+volatile uintptr_t *host_spibuf(void) {
+  host_spi_flush();
+  host_spi_run();
+  host_spi_status();
+  return &host_spiWrite;
+}
+
+void SPI_init(void) {
+  host_SPI2CON.reg |= SPI_ON;
+}
+
+void SPI_clock(u32 speed) {
+  host_spiCounts = 8 * (u64)HOST_CP0_HZ / speed;
+}
+
+void SPI_mode(u8 mode) {
+}
+
+void pinmode(u8 pin, u8 state) {
+}
+
+void digitalwrite(u8 pin, u8 state) {
+}
+
+volatile u32 *const host_lat[7][4] = {
+  { &LATA, &LATASET, &LATACLR, &LATAINV }, { &LATB, &LATBSET, &LATBCLR, &LATBINV },
+  { &LATC, &LATCSET, &LATCCLR, &LATCINV }, { &LATD, &LATDSET, &LATDCLR, &LATDINV },
+  { &LATE, &LATESET, &LATECLR, &LATEINV }, { &LATF, &LATFSET, &LATFCLR, &LATFINV },
+  { &LATG, &LATGSET, &LATGCLR, &LATGINV }
+};
+
+void host_lat_write(volatile u32 *reg, u32 mask) {
+  volatile u32 *lat;
+  u8 port;
+
+  *reg = mask;
+  for(port = 0; port < 7; port++) {
+    lat = host_lat[port][0];
+    if(reg == host_lat[port][1])
+      *lat |= mask;
+    else if(reg == host_lat[port][2])
+      *lat &= ~mask;
+    else if(reg == host_lat[port][3])
+      *lat ^= mask;
+    else
+      continue;
+    if(host_latWrites < HOST_LAT_MAX) {
+      host_latPort[host_latWrites] = port;
+      host_latValue[host_latWrites] = *lat;
+    }
+    host_latWrites++;
+    return;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// interrupts
+//////////////////////////////////////////////////////////////////////////////////
+void IntConfigureSystem(u8 config) {
+}
+
+void IntSetVectorPriority(u8 vector, u8 priority, u8 subpriority) {
+}
+
+void IntEnable(u8 irq) {
+  host_intOn[irq] = 1;
+}
+
+void IntDisable(u8 irq) {
+  host_intOn[irq] = 0;
+}
+
+u8 IntGetFlag(u8 irq) {
+  return host_intFlag[irq];
+}
+
+void IntClearFlag(u8 irq) {
+  host_intFlag[irq] = 0;
+}
+
+// CP0 counts of a timer period: TxCON prescaler, PRx, peripheral clocks
+u32 host_timer_counts(hostReg *con, hostReg *pr) {
+  static const u16 scaleB[8] = { 1, 2, 4, 8, 16, 32, 64, 256 };
+  u32 scale = scaleB[(host_reg(con)[0] >> 4) & 7];
+
+  return (u64)(host_reg(pr)[0] + 1) * scale * HOST_CP0_HZ / GetPeripheralClock();
+}
+
+void host_timer(hostReg *con, hostReg *pr, u32 *last, u8 irq, void (*handler)(void)) {
+  u32 period;
+
+  if(!(host_reg(con)[0] & TMR_ON)) {
+    *last = host_cp0;
+    return;
+  }
+  period = host_timer_counts(con, pr);
+  while(host_cp0 - *last >= period) {
+    *last += period;
+    host_intFlag[irq] = 1;
+    if(host_intOn[irq] && handler)
+      handler();
+  }
+}
+
+// the DMA channel takes a byte whenever the SPI TX buffer has room
+void host_dma(void) {
+  u32 size;
+
+  if(!(host_reg(&host_DMACON)[0] & DMA_ON) || !(host_reg(&host_DCH0CON)[0] & DMA_CHEN))
+    return;
+  if(!(host_reg(&host_DCH0ECON)[0] & DMA_SIRQEN) || ((host_DCH0ECON.reg >> 8) & 0xFF) != INT_SPI2_TX)
+    return;
+  size = host_reg(&host_DCH0SSIZ)[0] & 0xFF;
+  if(size == 0)
+    size = 256;
+  while(host_spiQueued < host_spi_depth()) {
+    host_spi_push(((u8 *)host_DCH0SSA.reg)[host_DCH0SPTR.reg++]);
+    if(host_DCH0SPTR.reg == size) {
+      host_DCH0SPTR.reg = 0;
+      host_DCH0CON.reg &= ~(uintptr_t)DMA_CHEN;
+      host_DCH0INT.reg |= DMA_CHBCIF;
+      host_dmaBlocks++;
+      break;
+    }
+  }
+  host_spi_status();
+}
+
+// the SPI TX interrupt flag, as STXISEL sets it
+void host_spi_irq(void) {
+  u8 empty;
+
+  host_fold(&host_SPI2CON);
+  if((host_SPI2CON.reg & SPI_STXISEL) && (host_SPI2CON.reg & SPI_ENHBUF))
+    empty = host_spiQueued <= host_spi_depth() / 2;
+  else
+    empty = host_spiQueued < host_spi_depth();
+  if(empty)
+    host_reg(&host_IFS1)[0] |= SPI_TX_BIT;
+  while((host_reg(&host_IEC1)[0] & SPI_TX_BIT) && (host_reg(&host_IFS1)[0] & SPI_TX_BIT) && SPI2Interrupt) {
+    host_spiIrqs++;
+    SPI2Interrupt();
+    host_fold(&host_IFS1);
+    if(host_spiQueued > host_spi_depth() / 2)
+      break;
+  }
+}
+
+// the hardware catches up with host_cp0: bytes shift out, the DMA channel refills
+void host_spi_run(void) {
+  static u8 running;
+
+  if(running)
+    return;
+  running = 1;
+  for(;;) {
+    host_dma();
+    if(host_spiQueued == 0 || host_cp0 - host_spiStart < host_spiCounts)
+      break;
+    if(host_spiBytes < HOST_SPI_MAX)
+      host_spiOut[host_spiBytes++] = host_spiQueue[0];
+    memmove(host_spiQueue, host_spiQueue + 1, --host_spiQueued);
+    host_spiStart += host_spiCounts;
+    host_spiShifted = 1;
+  }
+  host_spi_status();
+  running = 0;
+}
+
+void host_irqs(void) {
+  host_timer(&host_T4CON, &host_PR4, &host_t4Last, INT_TIMER4, Tmr4Interrupt);
+  if(!host_rxIrqOff)
+    host_timer(&host_T5CON, &host_PR5, &host_t5Last, INT_TIMER5, Tmr5Interrupt);
+  host_spi_run();
+  host_spi_irq();
+}
+
+void host_loop(void) {
+  host_irqs();
+  loop();
+}
+
+void host_run_us(u32 us) {
+  u64 end = host_us() + us;
+
+  while(host_us() < end)
+    host_loop();
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// CDC
+//////////////////////////////////////////////////////////////////////////////////
+void host_rx(const u8 *data, u32 n) {
+  if(host_rxLen + n > HOST_CDC_MAX) {
+    // move what is left to the front
+    if(host_rxLen - host_rxPos + n > HOST_CDC_MAX) {
+      printf("host: receive queue full\n");
+      host_failures++;
+      return;
+    }
+    memmove(host_rxData, host_rxData + host_rxPos, host_rxLen - host_rxPos);
+    host_rxLen -= host_rxPos;
+    host_rxPos = 0;
+  }
+  memcpy(host_rxData + host_rxLen, data, n);
+  host_rxLen += n;
+}
+
+u32 host_rx_left(void) {
+  return host_rxLen - host_rxPos;
+}
+
+u32 host_tx_left(void) {
+  return host_txLen - host_txPos;
+}
+
+u8 CDCgets(char *buffer) {
+  u32 n = host_rxLen - host_rxPos;
+
+  if(n > 64)
+    n = 64;
+  memcpy(buffer, host_rxData + host_rxPos, n);
+  host_rxPos += n;
+  return n;
+}
+
+void host_tx(const u8 *data, u32 n) {
+  if(host_txLen + n > HOST_CDC_MAX) {
+    memmove(host_txData, host_txData + host_txPos, host_txLen - host_txPos);
+    host_txLen -= host_txPos;
+    host_txPos = 0;
+  }
+  memcpy(host_txData + host_txLen, data, n);
+  host_txLen += n;
+}
+
+void CDCputs(u8 *buffer, u8 length) {
+  host_tx(buffer, length);
+}
+
+void CDCprintf(const char *fmt, ...) {
+  char text[256];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+  host_tx((const u8 *)text, strlen(text));
+}
+
+u8 USBUSARTIsTxTrfReady(void) {
+  return host_txSrc == 0;
+}
+
+void putUSBUSART(char *data, u8 length) {
+  if(host_txSrc) {
+    printf("host: putUSBUSART() while the last transfer is busy\n");
+    host_failures++;
+  }
+  host_txSrc = data;
+  host_txSrcLen = length;
+  host_txBusy = host_txLatency;
+  host_txPuts++;
+}
+
+// the transfer reads the data at its end, the caller has to leave it alone until then
+void CDCTxService(void) {
+  if(host_txSrc == 0 || host_txBusy-- > 0)
+    return;
+  host_tx((const u8 *)host_txSrc, host_txSrcLen);
+  host_txSrc = 0;
+}
+
+int host_packet(u8 *packet) {
+  u8 *p;
+  u32 left, len;
+  char *nl;
+
+  for(;;) {
+    p = host_txData + host_txPos;
+    left = host_txLen - host_txPos;
+    if(left >= 4 && memcmp(p, "LUMI", 4) == 0) {
+      if(left < 10)
+        return 0;
+      len = 10 + (p[8] | (p[9] << 8)) + 4;
+      if(left < len)
+        return 0;
+      memcpy(packet, p, len);
+      host_txPos += len;
+      return len;
+    }
+    nl = memchr(p, '\n', left);
+    if(nl == 0)
+      return 0;
+    len = nl - (char *)p;
+    if(len >= sizeof(host_text))
+      len = sizeof(host_text) - 1;
+    memcpy(host_text, p, len);
+    host_text[len] = 0;
+    host_txPos = nl + 1 - (char *)host_txData;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// pseudo terminal
+//////////////////////////////////////////////////////////////////////////////////
+u64 host_wall_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+const char *host_pty_open(void) {
+  struct termios tio;
+
+  host_ptyFd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(host_ptyFd < 0 || grantpt(host_ptyFd) != 0 || unlockpt(host_ptyFd) != 0) {
+    perror("host: posix_openpt");
+    exit(1);
+  }
+  // bytes as they are, no echo, no line editing
+  tcgetattr(host_ptyFd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(host_ptyFd, TCSANOW, &tio);
+  host_ptyStart = host_wall_ns() - host_us() * 1000;
+  return ptsname(host_ptyFd);
+}
+
+void host_pty_loop(void) {
+  u8 data[4096];
+  ssize_t n;
+  u64 wallUs;
+
+  // from the host, while the endpoint isn't far behind, USB holds it off then
+  if(host_rx_left() < sizeof(data)) {
+    n = read(host_ptyFd, data, sizeof(data));
+    if(n > 0)
+      host_rx(data, n);
+  }
+  host_loop();
+  // to the host, what it doesn't take now stays
+  if(host_txPos < host_txLen) {
+    n = write(host_ptyFd, host_txData + host_txPos, host_txLen - host_txPos);
+    if(n > 0)
+      host_txPos += n;
+  }
+  // the device runs no faster than the wall clock
+  wallUs = (host_wall_ns() - host_ptyStart) / 1000;
+  if(host_us() > wallUs + 1000)
+    usleep(host_us() - wallUs);
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// framing
+//////////////////////////////////////////////////////////////////////////////////
+u32 host_crc32(const u8 *data, u32 n) {
+  u32 crc = 0xFFFFFFFF;
+  u8 k;
+
+  while(n--) {
+    crc ^= *data++;
+    for(k = 0; k < 8; k++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+u32 host_u32(const u8 *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+u32 host_frame(u8 *out, u8 type, u8 flags, u16 id, const u8 *payload, u32 len) {
+  u32 crc;
+
+  memcpy(out, "LUMI", 4);
+  out[4] = type;
+  out[5] = flags;
+  out[6] = id;
+  out[7] = id >> 8;
+  out[8] = len;
+  out[9] = len >> 8;
+  if(len)
+    memcpy(out + 10, payload, len);
+  crc = host_crc32(out + 4, 6 + len);
+  out[10 + len] = crc;
+  out[11 + len] = crc >> 8;
+  out[12 + len] = crc >> 16;
+  out[13 + len] = crc >> 24;
+  return 14 + len;
+}
+
+void host_send(u8 type, u8 flags, u16 id, const u8 *payload, u32 len) {
+  static u8 packet[14 + 0x10000];
+
+  host_rx(packet, host_frame(packet, type, flags, id, payload, len));
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// codec
+//////////////////////////////////////////////////////////////////////////////////
+// same pixels from pixel i on, 128 at most
+u32 host_run(const u8 *frame, u32 i, u32 n, u32 pixelBytes) {
+  u32 run = 1;
+
+  while(run < 128 && i + run < n &&
+        memcmp(frame + i * pixelBytes, frame + (i + run) * pixelBytes, pixelBytes) == 0)
+    run++;
+  return run;
+}
+
+// one op from pixel i on, not past pixel n: a run of two or more, else the
+// pixels up to the next run. Returns its bytes, *count its pixels.
+u32 host_op(u8 *out, const u8 *frame, u32 i, u32 n, u32 pixelBytes, u32 *count) {
+  u32 run = host_run(frame, i, n, pixelBytes);
+
+  if(run >= 2) {
+    out[0] = 0x80 | (run - 1);
+    memcpy(out + 1, frame + i * pixelBytes, pixelBytes);
+    *count = run;
+    return 1 + pixelBytes;
+  }
+  for(run = 1; run < 128 && i + run < n && host_run(frame, i + run, n, pixelBytes) < 2; run++)
+    ;
+  out[0] = run - 1;
+  memcpy(out + 1, frame + i * pixelBytes, run * pixelBytes);
+  *count = run;
+  return 1 + run * pixelBytes;
+}
+
+u32 host_rle(u8 *out, const u8 *frame, u32 pixels, u32 pixelBytes) {
+  u32 len = 0, i, count;
+
+  for(i = 0; i < pixels; i += count)
+    len += host_op(out + len, frame, i, pixels, pixelBytes, &count);
+  return len;
+}
+
+u32 host_delta(u8 *out, u16 baseId, const u8 *frame, const u8 *base, u32 pixels, u32 pixelBytes) {
+  u32 len = 2, i = 0, skip, end, count;
+
+  out[0] = baseId;
+  out[1] = baseId >> 8;
+  for(;;) {
+    for(skip = 0; skip < 0xFFFF && i + skip < pixels &&
+        memcmp(frame + (i + skip) * pixelBytes, base + (i + skip) * pixelBytes, pixelBytes) == 0; skip++)
+      ;
+    // the pixels after the last pair stay
+    if(i + skip == pixels)
+      return len;
+    i += skip;
+    // the changes go on up to two pixels that stay
+    for(end = i + 1; end < pixels; end++) {
+      if(memcmp(frame + end * pixelBytes, base + end * pixelBytes, pixelBytes) == 0 &&
+         (end + 1 == pixels || memcmp(frame + (end + 1) * pixelBytes, base + (end + 1) * pixelBytes, pixelBytes) == 0))
+        break;
+    }
+    out[len++] = skip;
+    out[len++] = skip >> 8;
+    len += host_op(out + len, frame, i, end, pixelBytes, &count);
+    i += count;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// setup
+//////////////////////////////////////////////////////////////////////////////////
+void host_reset(void) {
+#define HOST_REG_CLEAR(name) memset((void *)&host_##name, 0, sizeof(hostReg));
+  HOST_REGS(HOST_REG_CLEAR)
+  host_cp0Step = 8;
+  host_cp0Hook = 0;
+  host_elapsed = 0;
+  host_spiCounts = 8 * 16;
+  host_spiBytes = 0;
+  host_spiQueued = 0;
+  host_spiShifted = 0;
+  host_spiWrite = HOST_NONE;
+  host_dmaBlocks = 0;
+  host_spiIrqs = 0;
+  host_latWrites = 0;
+  host_rxIrqOff = 0;
+  memset(host_intOn, 0, sizeof(host_intOn));
+  memset(host_intFlag, 0, sizeof(host_intFlag));
+  host_t4Last = host_t5Last = host_cp0;
+  host_rxLen = host_rxPos = 0;
+  host_txLen = host_txPos = 0;
+  host_txLatency = 0;
+  host_txPuts = 0;
+  host_txSrc = 0;
+  host_text[0] = 0;
+}
+
+int host_done(const char *name) {
+  if(host_failures)
+    printf("%s: %d failed\n", name, host_failures);
+  else
+    printf("%s: ok\n", name);
+  return host_failures != 0;
+}
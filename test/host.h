@@ -0,0 +1,94 @@
+// Host build of user.c
+// Stands in for main32.c on Linux: a test includes this, then the user.c
+// variant the Makefile made (USER_C). host.c runs the peripherals user.c
+// talks to on a simulated CP0 count:
+// - every GetCP0Count() moves the count on by host_cp0Step
+// - host_irqs() catches timer 4/5, the SPI and its DMA channel up with it and
+//   runs the interrupt handlers that are due
+// - the CDC endpoint takes what host_rx() queued and collects what the
+//   device sends for host_packet(), or a pseudo terminal connects it to a
+//   host program
+#ifndef __HOST_H
+#define __HOST_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <typedef.h>
+#include <digitalw.c>
+
+#define HOST_CP0_HZ  40000000	// CP0 counts per second, half the system clock
+#define HOST_SPI_MAX (1 << 22)	// bytes the SPI model keeps
+#define HOST_CDC_MAX (1 << 22)	// bytes either way the CDC endpoint keeps
+
+// clock
+extern u32 host_cp0;			// the CP0 count
+extern u32 host_cp0Step;		// counts a GetCP0Count() moves it on
+extern void (*host_cp0Hook)(void);	// runs after every GetCP0Count(), e.g. as an interrupt
+
+// peripherals
+extern u32 host_spiCounts;		// CP0 counts one byte takes on the SPI
+extern u8  host_spiOut[HOST_SPI_MAX];	// bytes the SPI shifted out
+extern u32 host_spiBytes;
+extern u32 host_dmaBlocks;		// DMA blocks done
+extern u32 host_spiIrqs;		// SPI TX interrupts run
+extern u8  host_rxIrqOff;		// 1: no timer 5, the test calls dl_rx_poll() itself
+extern u8  host_intFlag[64];		// interrupt flags, IFSx
+
+// pins: the LATxSET/CLR/INV writes of LWN_WRITE() in order, the port (pA to
+// pG) and its LATx after each. portmask[] and pinmask[] place the pins.
+#define HOST_LAT_MAX (1 << 20)
+extern u8  host_latPort[HOST_LAT_MAX];
+extern u32 host_latValue[HOST_LAT_MAX];
+extern u32 host_latWrites;		// may be more than HOST_LAT_MAX, the trace keeps the first
+
+void host_reset(void);
+void host_irqs(void);
+void host_loop(void);
+void host_run_us(u32 us);		// host_loop() until us passed
+u64  host_us(void);			// host_cp0 extended, in us since host_reset()
+
+// CDC
+extern u32 host_txLatency;		// CDCTxService() calls an IN transfer takes
+extern u32 host_txPuts;			// putUSBUSART() calls
+extern char host_text[256];		// the last text line from the device
+
+void host_rx(const u8 *data, u32 n);	// bytes from the host, CDCgets() hands them out
+u32  host_rx_left(void);
+int  host_packet(u8 *packet);		// next packet from the device, its length, 0 if none yet
+u32  host_tx_left(void);			// bytes from the device host_packet() didn't take yet
+
+// pseudo terminal: the endpoint's bytes go through its master instead of
+// host_rx() and host_packet(), a host program opens the slave
+const char *host_pty_open(void);	// the slave's name
+void host_pty_loop(void);		// host_loop(), the bytes both ways, in step with the wall clock
+
+// dataLink framing, as a host sends it
+u32  host_crc32(const u8 *data, u32 n);
+u32  host_frame(u8 *out, u8 type, u8 flags, u16 id, const u8 *payload, u32 len);
+void host_send(u8 type, u8 flags, u16 id, const u8 *payload, u32 len);
+u32  host_u32(const u8 *p);
+
+// DL_T_RLE and DL_T_DELTA payload of a frame of pixels in the host's layout,
+// as a host encodes it, the length. A host sends what isn't smaller than the
+// frame as DL_T_FRAME.
+u32  host_rle(u8 *out, const u8 *frame, u32 pixels, u32 pixelBytes);
+u32  host_delta(u8 *out, u16 baseId, const u8 *frame, const u8 *base, u32 pixels, u32 pixelBytes);
+
+// checks
+extern int host_failures;
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      host_failures++; \
+    } \
+  } while(0)
+#define CHECK_EQ(a, b) do { \
+    long long _a = (long long)(a), _b = (long long)(b); \
+    if(_a != _b) { \
+      printf("%s:%d: %s == %lld, expected %s == %lld\n", __FILE__, __LINE__, #a, _a, #b, _b); \
+      host_failures++; \
+    } \
+  } while(0)
+int host_done(const char *name);	// prints the result, main() returns it
+
+#endif
@@ -0,0 +1,12 @@
+// host build: the CDC endpoint, host.c feeds and reads it
+#ifndef __CDC_C
+#define __CDC_C
+#include <typedef.h>
+
+u8 CDCgets(char *buffer);
+void CDCputs(u8 *buffer, u8 length);
+void CDCprintf(const char *fmt, ...);
+u8 USBUSARTIsTxTrfReady(void);
+void putUSBUSART(char *data, u8 length);
+void CDCTxService(void);
+#endif
@@ -0,0 +1 @@
+// host build: user.c doesn't delay
@@ -0,0 +1,24 @@
+// host build: pin tables and digital I/O, main32.c brings them in on the board
+#ifndef __DIGITALW_C
+#define __DIGITALW_C
+#include <typedef.h>
+
+#define OUTPUT 0
+#define INPUT  1
+#define LOW    0
+#define HIGH   1
+
+#define pA 0
+#define pB 1
+#define pC 2
+#define pD 3
+#define pE 4
+#define pF 5
+#define pG 6
+
+extern u8  portmask[];	// port of each pin, tests set them
+extern u16 pinmask[];	// bit of each pin
+
+void pinmode(u8 pin, u8 state);
+void digitalwrite(u8 pin, u8 state);
+#endif
@@ -0,0 +1,23 @@
+// host build: interrupt control, host.c raises the flags and runs the handlers
+#ifndef __INTERRUPT_C
+#define __INTERRUPT_C
+
+#define INT_SYSTEM_CONFIG_MULT_VECTOR 1
+
+#define INT_CORE_TIMER_VECTOR 0
+#define INT_TIMER4_VECTOR     16
+#define INT_TIMER5_VECTOR     20
+#define INT_SPI2_VECTOR       31
+
+#define INT_CORE_TIMER 0
+#define INT_TIMER4     16
+#define INT_TIMER5     20
+#define INT_SPI2_TX    38
+
+void IntConfigureSystem(u8 config);
+void IntSetVectorPriority(u8 vector, u8 priority, u8 subpriority);
+void IntEnable(u8 irq);
+void IntDisable(u8 irq);
+u8 IntGetFlag(u8 irq);
+void IntClearFlag(u8 irq);
+#endif
@@ -0,0 +1,91 @@
+// host build: the PIC32 special function registers user.c touches.
+//
+// The DMA, SPI, timer and interrupt registers are emulated by host.c. A write
+// to xSET, xCLR or xINV is folded into the register at the next access to
+// any of the four, so user.c sees them the way the hardware applies them.
+// They are as wide as a pointer: DCHxSSA/DSA take host addresses, see
+// LW_KVA_TO_PA below. SPI2BUF hands every byte written to the SPI model.
+//
+// The LAT and TRIS registers are plain variables, their SET/CLR/INV are
+// variables of their own. Writes through LWN_WRITE() are folded into LATx
+// and recorded.
+#ifndef __REGS_H
+#define __REGS_H
+#include <stdint.h>
+
+typedef struct {
+  volatile uintptr_t reg, set, clr, inv;
+} hostReg;
+
+volatile uintptr_t *host_reg(hostReg *r);
+volatile uintptr_t *host_set(hostReg *r);
+volatile uintptr_t *host_clr(hostReg *r);
+volatile uintptr_t *host_inv(hostReg *r);
+volatile uintptr_t *host_spibuf(void);
+
+#define HOST_REGS(R) \
+  R(DMACON) R(DCH0CON) R(DCH0ECON) R(DCH0INT) R(DCH0SSA) R(DCH0DSA) \
+  R(DCH0SSIZ) R(DCH0DSIZ) R(DCH0SPTR) R(DCH0DPTR) R(DCH0CSIZ) R(DCH0CPTR) \
+  R(SPI2CON) R(SPI2STAT) R(SPI2BRG) \
+  R(T4CON) R(TMR4) R(PR4) R(T5CON) R(TMR5) R(PR5) \
+  R(IFS0) R(IFS1) R(IEC0) R(IEC1) R(IPC7)
+
+#define HOST_REG_DECLARE(name) extern hostReg host_##name;
+HOST_REGS(HOST_REG_DECLARE)
+
+#define DMACON      (*host_reg(&host_DMACON))
+#define DMACONSET   (*host_set(&host_DMACON))
+#define DMACONCLR   (*host_clr(&host_DMACON))
+#define DCH0CON     (*host_reg(&host_DCH0CON))
+#define DCH0CONSET  (*host_set(&host_DCH0CON))
+#define DCH0CONCLR  (*host_clr(&host_DCH0CON))
+#define DCH0ECON    (*host_reg(&host_DCH0ECON))
+#define DCH0ECONSET (*host_set(&host_DCH0ECON))
+#define DCH0ECONCLR (*host_clr(&host_DCH0ECON))
+#define DCH0INT     (*host_reg(&host_DCH0INT))
+#define DCH0INTSET  (*host_set(&host_DCH0INT))
+#define DCH0INTCLR  (*host_clr(&host_DCH0INT))
+#define DCH0SSA     (*host_reg(&host_DCH0SSA))
+#define DCH0DSA     (*host_reg(&host_DCH0DSA))
+#define DCH0SSIZ    (*host_reg(&host_DCH0SSIZ))
+#define DCH0DSIZ    (*host_reg(&host_DCH0DSIZ))
+#define DCH0SPTR    (*host_reg(&host_DCH0SPTR))
+#define DCH0DPTR    (*host_reg(&host_DCH0DPTR))
+#define DCH0CSIZ    (*host_reg(&host_DCH0CSIZ))
+#define DCH0CPTR    (*host_reg(&host_DCH0CPTR))
+#define SPI2CON     (*host_reg(&host_SPI2CON))
+#define SPI2CONSET  (*host_set(&host_SPI2CON))
+#define SPI2CONCLR  (*host_clr(&host_SPI2CON))
+#define SPI2STAT    (*host_reg(&host_SPI2STAT))
+#define SPI2BRG     (*host_reg(&host_SPI2BRG))
+#define SPI2BUF     (*host_spibuf())
+#define T4CON       (*host_reg(&host_T4CON))
+#define TMR4        (*host_reg(&host_TMR4))
+#define PR4         (*host_reg(&host_PR4))
+#define T5CON       (*host_reg(&host_T5CON))
+#define TMR5        (*host_reg(&host_TMR5))
+#define PR5         (*host_reg(&host_PR5))
+#define IFS0        (*host_reg(&host_IFS0))
+#define IFS1        (*host_reg(&host_IFS1))
+#define IFS1SET     (*host_set(&host_IFS1))
+#define IFS1CLR     (*host_clr(&host_IFS1))
+#define IEC0        (*host_reg(&host_IEC0))
+#define IEC1        (*host_reg(&host_IEC1))
+#define IEC1SET     (*host_set(&host_IEC1))
+#define IEC1CLR     (*host_clr(&host_IEC1))
+#define IPC7        (*host_reg(&host_IPC7))
+
+// the DMA model reads the host address back from DCH0SSA
+#define LW_KVA_TO_PA(v) ((uintptr_t)(v))
+
+#define HOST_LAT_DECLARE(name) extern volatile uint32_t name, name##SET, name##CLR, name##INV;
+HOST_LAT_DECLARE(LATA) HOST_LAT_DECLARE(LATB) HOST_LAT_DECLARE(LATC) HOST_LAT_DECLARE(LATD)
+HOST_LAT_DECLARE(LATE) HOST_LAT_DECLARE(LATF) HOST_LAT_DECLARE(LATG)
+HOST_LAT_DECLARE(TRISB) HOST_LAT_DECLARE(TRISD) HOST_LAT_DECLARE(TRISE)
+HOST_LAT_DECLARE(PORTB)
+#define _PORTA_RA0_MASK 1	// the chip has a port A
+
+// the soft SPI writes its pins through host_lat_write(), host.c records them
+void host_lat_write(volatile uint32_t *reg, uint32_t mask);
+#define LWN_WRITE(reg, mask) host_lat_write(reg, mask)
+#endif
@@ -0,0 +1,18 @@
+// host build: Pinguino's SPI2 helpers on the emulated registers
+#ifndef __SPI_C
+#define __SPI_C
+#include "regs.h"
+
+#define BUFFER SPI2BUF
+#define STATRX (SPI2STAT & 1)	// SPIRBF
+
+#define SPI_MASTER        1
+#define SPI_PBCLOCK_DIV2  2
+#define SPI_PBCLOCK_DIV4  4
+#define SPI_PBCLOCK_DIV8  8
+#define SPI_PBCLOCK_DIV16 16
+
+void SPI_init(void);
+void SPI_clock(u32 speed);
+void SPI_mode(u8 mode);
+#endif
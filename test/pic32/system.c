@@ -0,0 +1,11 @@
+// host build: clocks of an 80 MHz PIC32MX, the CP0 count is host_cp0 (host.c)
+#ifndef __SYSTEM_C
+#define __SYSTEM_C
+#include <typedef.h>
+#include "regs.h"
+
+u32 GetCP0Count(void);
+
+static inline u32 GetSystemClock(void) { return 80000000; }
+static inline u32 GetPeripheralClock(void) { return 40000000; }
+#endif
@@ -0,0 +1,91 @@
+// the CDC transmit ring: replies queued faster than USB takes them fill it,
+// the ones without room are dropped whole and counted, their ids stay used.
+// What is queued drains over many putUSBUSART() spans, around the end of the
+// ring, and reaches the host as whole packets with a good CRC.
+#include "host.h"
+#include USER_C
+
+#define REPLIES 200
+
+u32 received, lastId, gaps, badCrc;
+
+// take the packets the device sent, the ids counting up
+void take_replies() {
+  static u8 packet[DL_PACKET];
+  u32 id;
+  int len;
+
+  while((len = host_packet(packet)) > 0) {
+    if(host_crc32(packet + 4, len - 8) != host_u32(packet + len - 4))
+      badCrc++;
+    id = packet[6] | (packet[7] << 8);
+    if(received > 0)
+      gaps += (u16)(id - lastId - 1);
+    lastId = id;
+    received++;
+  }
+}
+
+// a reply of DL_MAX_REPLY bytes, the payload says which
+void send_reply(u32 k) {
+  u8 payload[DL_MAX_REPLY];
+
+  memset(payload, k, sizeof(payload));
+  dl_send(DL_T_CLOCK, payload, sizeof(payload));
+}
+
+int main() {
+  u32 k, dropped, fit;
+
+  host_reset();
+  setup();
+  host_run_us(10000);
+  take_replies();
+  host_text[0] = 0;
+  received = 0;
+
+  // USB doesn't take anything: the ring holds what fits, the rest is dropped whole
+  fit = CDC_TX_SIZE / (DL_HEADER + DL_MAX_REPLY + DL_TRAILER);
+  for(k = 0; k < 2 * fit; k++)
+    send_reply(k);
+  CHECK_EQ(cdc_txHead - cdc_txTail, fit * (DL_HEADER + DL_MAX_REPLY + DL_TRAILER));
+  CHECK_EQ(cdc_txDropped, fit);
+  host_run_us(10000);
+  take_replies();
+  CHECK_EQ(received, fit);
+  CHECK_EQ(gaps, 0);
+  CHECK_EQ(cdc_txHead, cdc_txTail);
+
+  // a slow USB, replies in between: some are dropped, the ones that go
+  // through span the end of the ring and several transfers
+  host_txLatency = 4;
+  dropped = cdc_txDropped;
+  for(k = 0; k < REPLIES; k++) {
+    send_reply(k);
+    send_reply(k);
+    host_loop();
+    host_loop();
+    take_replies();
+  }
+  // and one after all that goes through
+  host_run_us(100000);
+  send_reply(0);
+  host_run_us(100000);
+  take_replies();
+  dropped = cdc_txDropped - dropped;
+  CHECK(dropped > 0);
+  CHECK(received - fit > REPLIES);
+  CHECK(cdc_txHead > 4 * CDC_TX_SIZE);
+  CHECK(host_txPuts >= (received - fit) * DL_PACKET / CDC_TX_CHUNK);
+  printf("%u replies, %u dropped, %u transfers\n", received, cdc_txDropped, host_txPuts);
+  CHECK_EQ(received - fit + dropped, 2 * REPLIES + 1);
+  // the dropped ones, these and the first ones, are the gaps in the ids. No
+  // reply went out cut short.
+  CHECK_EQ(gaps, fit + dropped);
+  CHECK_EQ(badCrc, 0);
+  CHECK_EQ(host_tx_left(), 0);
+  CHECK_EQ(host_text[0], 0);
+  CHECK_EQ(cdc_txHead, cdc_txTail);
+  CHECK(cdc_txHighWater <= CDC_TX_SIZE);
+  return host_done(__FILE__);
+}
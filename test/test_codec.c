@@ -0,0 +1,116 @@
+// RLE and delta frames from the host's encoder through the device's decoder:
+// each frame goes as DL_T_DELTA on the newest one, then as DL_T_RLE, then as
+// DL_T_FRAME, all three have to leave the same bytes in the frame buffer.
+#include "host.h"
+#include USER_C
+
+#define FRAMES 300
+#define PAYLOAD_MAX (2 * FRAME_PIXEL_BYTES)
+
+enum { KIND_NOISE, KIND_RUNS, KIND_GRADIENT, KIND_SPARSE, KIND_SAME, KINDS };
+
+u32 rand_state = 2024;
+
+u32 rand32() {
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+}
+
+// the next frame, made from the last one
+void make_frame(u8 *frame, u8 kind) {
+  u32 i, n, at, len;
+
+  switch(kind) {
+  case KIND_NOISE:
+    for(i = 0; i < FRAME_PIXEL_BYTES; i++)
+      frame[i] = rand32();
+    break;
+  case KIND_RUNS:
+    for(i = 0; i < dl_pixels; i += len) {
+      len = 1 + rand32() % 300;
+      if(len > dl_pixels - i)
+        len = dl_pixels - i;
+      for(n = 0; n < FB_LED_BYTES; n++)
+        frame[i * FB_LED_BYTES + n] = rand32();
+      for(n = FB_LED_BYTES; n < len * FB_LED_BYTES; n++)
+        frame[i * FB_LED_BYTES + n] = frame[i * FB_LED_BYTES + n - FB_LED_BYTES];
+    }
+    break;
+  case KIND_GRADIENT:
+    at = rand32();
+    for(i = 0; i < FRAME_PIXEL_BYTES; i++)
+      frame[i] = (at + i / 7) & 0x7F;
+    break;
+  case KIND_SPARSE:
+    // a few spots change, some of them at the ends
+    for(n = rand32() % 12; n > 0; n--) {
+      at = (n == 1) ? 0 : (n == 2) ? dl_pixels - 1 : rand32() % dl_pixels;
+      for(len = 1 + rand32() % 200; len > 0 && at < dl_pixels; len--, at++)
+        for(i = 0; i < FB_LED_BYTES; i++)
+          frame[at * FB_LED_BYTES + i] = rand32();
+    }
+    break;
+  }
+}
+
+// send payload as type, or the frame if it isn't smaller; the bytes it left
+void send_as(u8 type, u16 id, const u8 *frame, const u8 *payload, u32 len, u8 *result) {
+  if(len >= FRAME_PIXEL_BYTES)
+    host_send(DL_T_FRAME, 0, id, frame, FRAME_PIXEL_BYTES);
+  else
+    host_send(type, 0, id, payload, len);
+  do
+    dl_rx_poll();
+  while(dataLink_process() || host_rx_left() > 0);
+  memcpy(result, frame_buff[fb_newest], FRAME_BYTES);
+}
+
+int main() {
+  static u8 frame[FRAME_PIXEL_BYTES], last[FRAME_PIXEL_BYTES];
+  static u8 payload[PAYLOAD_MAX];
+  static u8 delta[FRAME_BYTES], rle[FRAME_BYTES], whole[FRAME_BYTES];
+  u32 k, bad = 0, deltaLen, rleLen;
+  u64 deltaBytes = 0, rleBytes = 0;
+  u16 id = 0;
+  u8 kind;
+
+  host_reset();
+  host_rxIrqOff = 1;
+  setup();
+
+  // the first one for the delta to start from
+  memset(last, 0, sizeof(last));
+  host_send(DL_T_FRAME, 0, id++, last, sizeof(last));
+
+  for(k = 0; k < FRAMES; k++) {
+    memcpy(frame, last, sizeof(frame));
+    kind = (k < KINDS) ? k : rand32() % KINDS;
+    make_frame(frame, kind);
+
+    deltaLen = host_delta(payload, id - 1, frame, last, dl_pixels, FB_LED_BYTES);
+    deltaBytes += deltaLen;
+    send_as(DL_T_DELTA, id++, frame, payload, deltaLen, delta);
+    rleLen = host_rle(payload, frame, dl_pixels, FB_LED_BYTES);
+    rleBytes += rleLen;
+    send_as(DL_T_RLE, id++, frame, payload, rleLen, rle);
+    send_as(DL_T_FRAME, id++, frame, frame, FRAME_PIXEL_BYTES, whole);
+
+    if(memcmp(delta, whole, FRAME_BYTES) != 0 && bad++ < 4)
+      printf("frame %u kind %u: delta of %u bytes made another frame\n", k, kind, deltaLen);
+    if(memcmp(rle, whole, FRAME_BYTES) != 0 && bad++ < 4)
+      printf("frame %u kind %u: RLE of %u bytes made another frame\n", k, kind, rleLen);
+    if(kind == KIND_SAME)
+      CHECK_EQ(deltaLen, 2);
+    if(kind == KIND_RUNS)
+      CHECK(rleLen < FRAME_PIXEL_BYTES / 4);
+    memcpy(last, frame, sizeof(last));
+  }
+
+  CHECK_EQ(bad, 0);
+  CHECK_EQ(fb_received, 1 + 3 * FRAMES);
+  CHECK_EQ(dl_packets, 1 + 3 * FRAMES);
+  CHECK_EQ(dl_crcErrors + dl_badHeaders, 0);
+  printf("%u frames of %u bytes: delta %u, RLE %u bytes on average\n", FRAMES, FRAME_PIXEL_BYTES,
+         (u32)(deltaBytes / FRAMES), (u32)(rleBytes / FRAMES));
+  return host_done(__FILE__);
+}
@@ -0,0 +1,168 @@
+// fences: fb_latched() of a frame turns 1 only once every writer latched it
+// or a newer one, and DL_T_LATCHED names a frame packet only then: the latch
+// of one frame doesn't report the next, already in and fenced. A frame
+// FB_LATE_DROP throws away is latched with the next one that goes out.
+#include "host.h"
+#include USER_C
+
+#define FRAMES 20
+#define IDS    0x10000
+
+u32 fenceOf[IDS];		// fence of each frame packet, 0 for none yet
+u32 reported, lastReported = IDS;
+u32 arrived;			// fb_received of the frame packets fenceOf[] has
+u16 nextId;			// id of the next frame packet to arrive
+
+// every writer shows the frame of fence or a newer one
+u8 all_latched(u32 fence) {
+  u8 i;
+
+  for(i = 0; i < FB_WRITERS; i++)
+    if((s32)(fb_writerLatched[i] - fence) < 0)
+      return 0;
+  return 1;
+}
+
+// one turn of the loop, a DL_T_LATCHED checked as it comes
+void step() {
+  static u8 reply[DL_PACKET];
+  u16 id;
+
+  host_loop();
+  // fb_present() gives one fence after the other
+  for(; arrived != fb_received; arrived++)
+    fenceOf[nextId++] = fb_lastSeq - (fb_received - arrived - 1);
+  while(host_packet(reply) > 0) {
+    if(reply[4] != DL_T_LATCHED)
+      continue;
+    id = reply[DL_HEADER] | (reply[DL_HEADER + 1] << 8);
+    CHECK(fenceOf[id] != 0);
+    if(!all_latched(fenceOf[id]) || !fb_latched(fenceOf[id])) {
+      printf("DL_T_LATCHED %u before every writer latched it\n", id);
+      host_failures++;
+    }
+    lastReported = id;
+    reported++;
+  }
+}
+
+void run_us(u32 us) {
+  u64 end = host_us() + us;
+
+  while(host_us() < end)
+    step();
+}
+
+// a frame packet, timed if late is not 0: due late us ago, or -late us ahead.
+// One colour, run length coded: a few bytes that are in before the writers
+// latched the frame ahead of it.
+void queue_frame(u16 id, s32 late) {
+  static u8 frame[FRAME_PIXEL_BYTES], payload[DL_PTS_BYTES + 2 * FRAME_PIXEL_BYTES];
+  u32 len;
+
+  memset(frame, id & 0x7F, sizeof(frame));
+  len = host_rle(payload + DL_PTS_BYTES, frame, dl_pixels, FB_LED_BYTES);
+  if(late) {
+    dl_put_u32(payload, clock_us() - late);
+    host_send(DL_T_RLE, DL_F_PTS, id, payload, DL_PTS_BYTES + len);
+  } else {
+    host_send(DL_T_RLE, 0, id, payload + DL_PTS_BYTES, len);
+  }
+}
+
+// count more frame packets have arrived
+void wait_frames(u16 count) {
+  u32 received = fb_received;
+
+  while(fb_received != received + count)
+    step();
+}
+
+void send_frame(u16 id, s32 late) {
+  queue_frame(id, late);
+  wait_frames(1);
+}
+
+int main() {
+  u32 fence, k;
+  u16 id = 0;
+
+  host_reset();
+  setup();
+  run_us(1000);
+
+  // a producer of its own: the fence turns with the writers
+  memset(fb_acquire(), 0x80, FRAME_BYTES);
+  fence = fb_present(FRAME_BYTES, 0, 0);
+  arrived = fb_received;
+  pixels = fb_acquire();
+  CHECK(fence != 0);
+  CHECK(!fb_latched(fence));
+  for(k = 0; k < 100000 && !fb_latched(fence); k++) {
+    step();
+    if(fb_latched(fence) && !all_latched(fence)) {
+      printf("fence %u latched before every writer had it\n", fence);
+      host_failures++;
+    }
+  }
+  CHECK(fb_latched(fence));
+
+  // frame packets, a few at a time: each reported once latched, the last one too
+  for(k = 0; k < FRAMES; k++) {
+    send_frame(id++, 0);
+    if(k % 3 == 2)
+      run_us(30000);
+  }
+  run_us(100000);
+  CHECK(reported > 0);
+  CHECK_EQ(lastReported, id - 1);
+  CHECK_EQ(dl_fences, 0);
+
+  // the next one in before the writers latched one: the latch of that one
+  // doesn't report the next, due 600 ms later. Where only one frame may wait
+  // the next comes while the slow writers draw the first.
+  reported = 0;
+#if FB_QUEUE > 1
+  queue_frame(id, -20000);
+  queue_frame(id + 1, -620000);
+  wait_frames(2);
+  id += 2;
+#else
+  send_frame(id++, 0);
+  while(fb_seq[fb_current] != fenceOf[id - 1])
+    step();
+  send_frame(id++, -600000);
+#endif
+  CHECK(!fb_latched(fenceOf[id - 2]));
+  for(k = 0; k < 100000 && !fb_latched(fenceOf[id - 2]); k++)
+    step();
+  run_us(1000);
+  CHECK(!fb_latched(fenceOf[id - 1]));
+  CHECK_EQ(reported, 1);
+  CHECK_EQ(lastReported, id - 2);
+  CHECK_EQ(dl_fences, 1);
+  run_us(1000000);
+  CHECK_EQ(reported, 2);
+  CHECK_EQ(lastReported, id - 1);
+  CHECK_EQ(dl_fences, 0);
+
+  // a frame due 10 ms ago
+  reported = 0;
+  send_frame(id++, 10000);
+  run_us(100000);
+#ifdef FB_LATE_DROP
+  // thrown away, nothing latched: it waits for the next one
+  CHECK_EQ(fb_lateDropped, 1);
+  CHECK_EQ(reported, 0);
+  CHECK_EQ(dl_fences, 1);
+  send_frame(id++, 0);
+  run_us(100000);
+#else
+  CHECK_EQ(fb_late, 1);
+#endif
+  CHECK_EQ(reported, 1);
+  CHECK_EQ(lastReported, id - 1);
+  CHECK(fb_latched(fenceOf[id - 1]));
+  CHECK_EQ(dl_fences, 0);
+  return host_done(__FILE__);
+}
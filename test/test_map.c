@@ -0,0 +1,93 @@
+// DL_T_MAP: a map keeps one LED per pixel. One that would put two pixels on
+// an LED gets a NACK and the map stays, a frame then covers every LED.
+#include "host.h"
+#include USER_C
+
+u16 id;
+
+// send a map packet and run until the device answered; the NACK reason, 0 for none
+u8 send_map(u16 first, const u16 *pos, u32 n) {
+  static u8 payload[2 + 2 * LEDS], reply[DL_PACKET];
+  u32 i;
+  u8 reason = 0;
+
+  payload[0] = first;
+  payload[1] = first >> 8;
+  for(i = 0; i < n; i++) {
+    payload[2 + 2 * i] = pos[i];
+    payload[3 + 2 * i] = pos[i] >> 8;
+  }
+  host_send(DL_T_MAP, 0, id, payload, 2 + 2 * n);
+  host_run_us(20000);
+  while(host_packet(reply) > 0) {
+    if(reply[4] == DL_T_NACK && (reply[DL_HEADER] | (reply[DL_HEADER + 1] << 8)) == id)
+      reason = reply[DL_HEADER + 2];
+  }
+  id++;
+  return reason;
+}
+
+u32 map_sum() {
+  u32 i, sum = 0;
+
+  for(i = 0; i < LEDS; i++)
+    sum = sum * 31 + dl_map[i];
+  return sum;
+}
+
+int main() {
+  static u8 frame[FRAME_PIXEL_BYTES];
+  static u16 pos[LEDS];
+  u32 i, sum, bad = 0;
+
+  host_reset();
+  setup();
+  host_run_us(1000);
+  CHECK_EQ(dl_pixels, LEDS);
+
+  // a whole map, the chain backwards
+  for(i = 0; i < dl_pixels; i++)
+    pos[i] = LEDS - 1 - i;
+  CHECK_EQ(send_map(0, pos, dl_pixels), 0);
+  for(i = 0; i < dl_pixels; i++)
+    CHECK_EQ(dl_map[i], LEDS - 1 - i);
+
+  // two pixels of the packet on one LED
+  sum = map_sum();
+  pos[0] = 5;
+  pos[1] = 5;
+  CHECK_EQ(send_map(0, pos, 2), DL_NACK_DATA);
+  CHECK_EQ(map_sum(), sum);
+
+  // a new pixel on the LED of one the packet leaves alone
+  pos[0] = dl_map[20];
+  CHECK_EQ(send_map(10, pos, 1), DL_NACK_DATA);
+  CHECK_EQ(map_sum(), sum);
+
+  // a swap in one packet is fine
+  for(i = 0; i <= 10; i++)
+    pos[i] = dl_map[10 + i];
+  pos[0] = dl_map[20];
+  pos[10] = dl_map[10];
+  CHECK_EQ(send_map(10, pos, 11), 0);
+  CHECK_EQ(dl_map[10], LEDS - 1 - 20);
+  CHECK_EQ(dl_map[20], LEDS - 1 - 10);
+
+  // out of the chain
+  pos[0] = LEDS;
+  CHECK_EQ(send_map(0, pos, 1), DL_NACK_DATA);
+
+  // every LED shows the newest frame, none keeps one from before
+  memset(frame, 0x11, sizeof(frame));
+  host_send(DL_T_FRAME, 0, id++, frame, sizeof(frame));
+  host_run_us(20000);
+  memset(frame, 0x22, sizeof(frame));
+  host_send(DL_T_FRAME, 0, id++, frame, sizeof(frame));
+  host_run_us(20000);
+  for(i = 0; i < LEDS * 3; i++) {
+    if(FB_WIRE_BYTE(frame_buff[fb_newest], i) != (0x22 | 0x80) && bad++ < 4)
+      printf("wire byte %u: 0x%02x\n", i, FB_WIRE_BYTE(frame_buff[fb_newest], i));
+  }
+  CHECK_EQ(bad, 0);
+  return host_done(__FILE__);
+}
@@ -0,0 +1,131 @@
+// FRAME_INDEXED: DL_T_PALETTE sets the colors of indexes, a frame of indexes
+// goes out as the wire bytes of its colors, expanded block by block for the
+// DMA (palette) or byte by byte (palette_poll). A palette that comes while a
+// frame goes out takes effect at once: the rest of that frame has the new
+// colors, then the frame goes out again in full. One past index 255 gets a NACK.
+#include "host.h"
+#include USER_C
+
+u16 id;
+u8 rgb[256][3];			// the colors the host set, RGB
+
+// send colors [first, first + n) of rgb, don't wait for the device
+void queue_palette(u32 first, u32 n) {
+  static u8 payload[1 + 256 * 3];
+
+  payload[0] = first;
+  memcpy(payload + 1, rgb[first], n * 3);
+  host_send(DL_T_PALETTE, 0, id++, payload, 1 + n * 3);
+}
+
+// send a palette packet and run until the device answered; the NACK reason, 0 for none
+u8 send_palette(u32 first, u32 n) {
+  static u8 reply[DL_PACKET];
+  u16 sent = id;
+  u8 reason = 0;
+
+  queue_palette(first, n);
+  host_run_us(30000);
+  while(host_packet(reply) > 0) {
+    if(reply[4] == DL_T_NACK && (reply[DL_HEADER] | (reply[DL_HEADER + 1] << 8)) == sent)
+      reason = reply[DL_HEADER + 2];
+  }
+  return reason;
+}
+
+// the wire bytes of a frame of indexes with the colors of rgb
+void expand(u8 *wire, const u8 *frame) {
+  u32 i;
+  u8 c;
+
+  for(i = 0; i < LEDS; i++)
+    for(c = 0; c < 3; c++)
+      wire[3 * dl_map[i] + colorOffsetMap[c]] = rgb[frame[i]][c] | 0x80;
+}
+
+// a frame that differs from the last one in every pixel
+void send_frame(u8 *frame, u32 k) {
+  u32 i;
+
+  for(i = 0; i < LEDS; i++)
+    frame[i] = i * 7 + k;
+  host_send(DL_T_FRAME, 0, id++, frame, LEDS);
+}
+
+// the bytes the SPI shifted out since mark: leds of wire, then latch zeros
+void check_stream(u32 mark, const u8 *wire, u32 leds) {
+  u32 n = leds * 3 + ZEROS_FOR(leds);
+  u32 i, bad = 0;
+
+  CHECK(host_spiBytes - mark >= n);
+  for(i = 0; i < n && mark + i < host_spiBytes; i++) {
+    u8 expect = (i < leds * 3) ? wire[i] : 0x00;
+    if(host_spiOut[mark + i] != expect && bad++ < 4)
+      printf("byte %u: 0x%02x, expected 0x%02x\n", i, host_spiOut[mark + i], expect);
+  }
+  CHECK_EQ(bad, 0);
+}
+
+int main() {
+  static u8 frame[LEDS], wire[LEDS * 3], wireNew[LEDS * 3];
+  u32 mark, sent, i, at, bad;
+
+  host_reset();
+  setup();
+  host_run_us(30000);
+  // black until the host sends a palette
+  for(i = 0; i < 256; i++)
+    CHECK(fb_palette[i][0] == 0x80 && fb_palette[i][1] == 0x80 && fb_palette[i][2] == 0x80);
+
+  // a palette in two packets, each sends the newest frame again
+  for(i = 0; i < 256; i++) {
+    rgb[i][0] = i >> 1;
+    rgb[i][1] = (i * 3) & 0x7F;
+    rgb[i][2] = (255 - i) >> 1;
+  }
+  CHECK_EQ(send_palette(0, 128), 0);
+  CHECK_EQ(send_palette(128, 128), 0);
+  CHECK_EQ(fb_received, 2);
+  for(i = 0; i < 256; i++)
+    CHECK(fb_palette[i][colorOffsetMap[0]] == (rgb[i][0] | 0x80) && fb_palette[i][colorOffsetMap[2]] == (rgb[i][2] | 0x80));
+
+  // a frame of indexes goes out as their colors
+  mark = host_spiBytes;
+  send_frame(frame, 0);
+  host_run_us(30000);
+  expand(wire, frame);
+  check_stream(mark, wire, LEDS);
+
+  // colors past index 255: NACK, the palette stays
+  CHECK_EQ(send_palette(250, 7), DL_NACK_DATA);
+  CHECK_EQ(fb_palette[250][colorOffsetMap[0]], rgb[250][0] | 0x80);
+
+  // a palette while a frame goes out
+  mark = host_spiBytes;
+  sent = lw_framesSent;
+  send_frame(frame, 1);
+  expand(wire, frame);
+  while(host_spiBytes - mark < LEDS * 3 / 4)
+    host_loop();
+  for(i = 0; i < 256; i++) {
+    rgb[i][0] = (255 - i) >> 1;
+    rgb[i][1] = i >> 1;
+    rgb[i][2] = (i * 5) & 0x7F;
+  }
+  queue_palette(0, 256);
+  host_run_us(30000);
+  expand(wireNew, frame);
+  // the old colors up to where the palette came, the new ones from there
+  for(at = 0; at < LEDS * 3 && host_spiOut[mark + at] == wire[at]; at++)
+    ;
+  for(i = at, bad = 0; i < LEDS * 3; i++)
+    bad += host_spiOut[mark + i] != wireNew[i];
+  printf("the palette took effect at wire byte %u of %u\n", at, LEDS * 3);
+  CHECK(at > 0 && at < LEDS * 3);
+  CHECK_EQ(bad, 0);
+  // then all of it again in the new colors
+  CHECK_EQ(lw_framesSent, sent + 2);
+  check_stream(mark + LEDS * 3 + ZEROS_NEEDED, wireNew, LEDS);
+  CHECK_EQ(host_spiBytes, mark + 2 * (LEDS * 3 + ZEROS_NEEDED));
+  return host_done(__FILE__);
+}
@@ -0,0 +1,184 @@
+// dl_parse() fuzzed: good frame packets, each after a damaged copy of itself
+// (a flipped bit, cut short, bytes put in) or line noise. Every good packet
+// has to come through, the first one after the damage too, and no damaged one
+// may reach a frame buffer.
+#include "host.h"
+#include USER_C
+
+#define PACKETS 3000
+#define PACKET_MAX (DL_HEADER + FRAME_PIXEL_BYTES + DL_TRAILER)
+
+enum { DAMAGE_NONE, DAMAGE_FLIP, DAMAGE_CUT, DAMAGE_INSERT, DAMAGE_NOISE, DAMAGES };
+
+u32 rand_state = 4711;
+
+u32 rand32() {
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+}
+
+// packet k: every pixel byte the same value, the id says which
+u8 frame_value(u32 k) {
+  return (k * 13 + 1) & 0x7F;
+}
+
+u32 presented, bad;
+
+// a frame came: it has to be the next good packet's
+void check_newest() {
+  u8 *newest = frame_buff[fb_newest];
+  u32 i;
+
+  if((fb_received != presented + 1 || dl_newestId != (u16)presented) && bad++ < 4)
+    printf("packet %u: %u frames, newest id %u\n", presented, fb_received, dl_newestId);
+  for(i = 0; i < FRAME_PIXEL_BYTES; i++) {
+    if(newest[i] != (frame_value(dl_newestId) | 0x80)) {
+      if(bad++ < 4)
+        printf("packet %u byte %u: 0x%02x, expected 0x%02x\n",
+               dl_newestId, i, newest[i], frame_value(dl_newestId) | 0x80);
+      break;
+    }
+  }
+  presented = fb_received;
+}
+
+// everything queued through the ring, a dataLink_process() step at a time
+void drain() {
+  u8 more = 1;
+
+  while(host_rx_left() > 0 || more) {
+    dl_rx_poll();
+    more = dataLink_process();
+    if(fb_received != presented)
+      check_newest();
+  }
+}
+
+// a full ring, and the magic of the first packet split over two
+// dataLink_process() steps: the tail may not give back the half of the magic
+// the first step found, or the ring runs over the packet
+void check_split_magic() {
+  static u8 frame[FRAME_PIXEL_BYTES], packet[PACKET_MAX], noise[DL_RX_BATCH - 2];
+  u32 received = fb_received, crcErrors = dl_crcErrors, frames, k, len, over = 0;
+
+  memset(noise, 0x11, sizeof(noise));
+  host_rx(noise, sizeof(noise));
+  frames = 2 * DL_RING_SIZE / PACKET_MAX + 2;
+  for(k = 0; k < frames; k++) {
+    memset(frame, frame_value(k), sizeof(frame));
+    len = host_frame(packet, DL_T_FRAME, 0, PACKETS + 1 + k, frame, sizeof(frame));
+    host_rx(packet, len);
+  }
+  while(dl_ringHead - dl_ringTail + DL_PACKET <= DL_RING_SIZE)
+    dl_rx_poll();
+  CHECK_EQ(dl_ringHead - dl_ringTail, DL_RING_SIZE);
+  do {
+    dataLink_process();
+    dl_rx_poll();
+    if(dl_ringHead - dl_ringTail > DL_RING_SIZE && over++ < 4)
+      printf("%u bytes in a ring of %u\n", dl_ringHead - dl_ringTail, DL_RING_SIZE);
+  } while(host_rx_left() > 0 || dl_ringHead != dl_parsePos);
+  CHECK_EQ(over, 0);
+  CHECK_EQ(dl_crcErrors, crcErrors);
+  CHECK_EQ(fb_received, received + frames);
+}
+
+// a host that stops in the middle of a packet, as one that waits for credit
+// after a packet with a bad len: the device gives up on it after
+// DL_PACKET_TIMEOUT, not DATA_LINK_TIMEOUT, and sends its credit again
+void check_packet_timeout() {
+  static u8 frame[FRAME_PIXEL_BYTES], packet[PACKET_MAX], reply[DL_PACKET];
+  u32 len = host_frame(packet, DL_T_FRAME, 0, PACKETS, frame, sizeof(frame));
+  u32 timeouts = dl_timeouts;
+  u8 credit = 0;
+  int n;
+
+  host_rxIrqOff = 0;
+  host_run_us(1000);
+  while(host_packet(reply) > 0)
+    ;
+  host_rx(packet, len / 2);
+  host_run_us(DL_PACKET_TIMEOUT * 1000 / 2);
+  CHECK(dl_state != DL_P_HUNT);
+  CHECK_EQ(dl_timeouts, timeouts);
+  host_run_us(DL_PACKET_TIMEOUT * 1000);
+  CHECK_EQ(dl_state, DL_P_HUNT);
+  CHECK_EQ(dl_timeouts, timeouts + 1);
+  CHECK_EQ(dl_ringTail, dl_ringHead);
+  while((n = host_packet(reply)) > 0)
+    credit |= reply[4] == DL_T_CREDIT;
+  CHECK(credit);
+}
+
+int main() {
+  static u8 frame[FRAME_PIXEL_BYTES];
+  static u8 packet[PACKET_MAX + 64];
+  static u8 damaged[PACKET_MAX + 64];
+  u32 damages[DAMAGES] = { 0 };
+  u32 k, n, len, cut, i;
+  u8 kind;
+
+  host_reset();
+  host_rxIrqOff = 1;
+  setup();
+
+  for(k = 0; k < PACKETS; k++) {
+    memset(frame, frame_value(k), sizeof(frame));
+    len = host_frame(packet, DL_T_FRAME, 0, k, frame, sizeof(frame));
+
+    kind = (k < DAMAGES) ? k : rand32() % DAMAGES;
+    damages[kind]++;
+    memcpy(damaged, packet, len);
+    switch(kind) {
+    case DAMAGE_FLIP:
+      // not in the magic, that only makes it noise
+      i = 4 + rand32() % (len - 4);
+      damaged[i] ^= 1 << (rand32() % 8);
+      host_rx(damaged, len);
+      break;
+    case DAMAGE_CUT:
+      // anywhere, in the magic, the header, the payload or the CRC
+      cut = 1 + rand32() % (len - 1);
+      host_rx(damaged, cut);
+      break;
+    case DAMAGE_INSERT:
+      cut = 4 + rand32() % (len - 4);
+      n = 1 + rand32() % 64;
+      memmove(damaged + cut + n, damaged + cut, len - cut);
+      for(i = 0; i < n; i++)
+        damaged[cut + i] = rand32();
+      host_rx(damaged, len + n);
+      break;
+    case DAMAGE_NOISE:
+      // with bits of the magic in it
+      n = 1 + rand32() % 64;
+      for(i = 0; i < n; i++)
+        damaged[i] = (rand32() % 4 == 0) ? dl_magic[rand32() % 4] : rand32();
+      host_rx(damaged, n);
+      break;
+    }
+    host_rx(packet, len);
+    drain();
+    // noise that looks like a header holds a good packet back until the
+    // bytes it claims are there, that is the next packet at most
+    if(fb_received < k && bad++ < 4)
+      printf("packet %u: only %u frames\n", k, fb_received);
+  }
+  // the end, for a header the noise made up
+  memset(packet, 0, sizeof(packet));
+  host_rx(packet, sizeof(packet));
+  drain();
+
+  CHECK_EQ(bad, 0);
+  CHECK_EQ(fb_received, PACKETS);
+  CHECK_EQ(dl_packets, PACKETS);
+  CHECK_EQ(dl_lostIds, 0);
+  // every flipped bit and every insert breaks a CRC or a header
+  CHECK(dl_crcErrors + dl_badHeaders >= damages[DAMAGE_FLIP] + damages[DAMAGE_INSERT]);
+  CHECK_EQ(dl_state, DL_P_HUNT);
+  CHECK_EQ(dl_ringTail, dl_ringHead);
+
+  check_split_magic();
+  check_packet_timeout();
+  return host_done(__FILE__);
+}
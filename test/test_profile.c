@@ -0,0 +1,107 @@
+// PROFILE in the host build: prof_add() bins and figures, PROF_ADD() in the
+// scheduler against a task of known cost on the simulated clock, and the
+// DL_T_PROFILE answer with and without clearing the figures.
+#include "host.h"
+#include USER_C
+
+#define PROBE_CALLS 25		// GetCP0Count() calls of one step of the probe task
+
+u8 probe_process() {
+  u32 i;
+
+  for(i = 0; i < PROBE_CALLS; i++)
+    GetCP0Count();
+  return 0;
+}
+
+u32 get_u32(const u8 *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+// ask for the figures, find the ones of name; 1 if they came with the histogram
+u8 ask_profile(u16 id, u8 clear, const char *name, u32 *calls, u32 *min, u32 *avg, u32 *max) {
+  static u8 reply[DL_PACKET];
+  u8 *payload = reply + DL_HEADER;
+  u8 probe = 0xFF, found = 0;
+  u32 k, sum;
+
+  host_send(DL_T_PROFILE, 0, id, &clear, clear);
+  host_run_us(20000);
+  while(host_packet(reply) > 0) {
+    if(reply[4] != DL_T_PROFILE)
+      continue;
+    if(payload[1] == 0 && strncmp((char *)payload + 2, name, 8) == 0) {
+      probe = payload[0];
+      *calls = get_u32(payload + 10);
+      *min = get_u32(payload + 14);
+      *avg = get_u32(payload + 18);
+      *max = get_u32(payload + 22);
+    }
+    if(payload[1] == 1 && payload[0] == probe) {
+      for(k = 0, sum = 0; k < PROF_BINS; k++)
+        sum += payload[2 + 2 * k] | (payload[3 + 2 * k] << 8);
+      found = (sum == *calls || sum >= 0xFFFF);
+    }
+  }
+  return found;
+}
+
+int main() {
+  profProbe probe;
+  u32 cost, steps, calls, min, avg, max, i;
+  u8 task;
+
+  // bins: [2^k, 2^(k+1)), 0 with 1, the last one all longer
+  memset(&probe, 0, sizeof(probe));
+  probe.min = 0xFFFFFFFF;
+  prof_add(&probe, 0);
+  prof_add(&probe, 1);
+  prof_add(&probe, 3);
+  prof_add(&probe, 1000);
+  prof_add(&probe, 1 << (PROF_BINS - 1));
+  prof_add(&probe, 0xFFFFFFFF);
+  CHECK_EQ(probe.calls, 6);
+  CHECK_EQ(probe.min, 0);
+  CHECK_EQ(probe.max, 0xFFFFFFFF);
+  CHECK_EQ(probe.sum, 0 + 1 + 3 + 1000 + (1 << (PROF_BINS - 1)) + 0xFFFFFFFFull);
+  CHECK_EQ(probe.bins[0], 2);
+  CHECK_EQ(probe.bins[1], 1);
+  CHECK_EQ(probe.bins[9], 1);
+  CHECK_EQ(probe.bins[PROF_BINS - 1], 2);
+
+  host_reset();
+  setup();
+  task = sched_tasks;
+  sched_add("probe", probe_process, 6, 0, 0);
+  host_run_us(50000);
+
+  // a step is the GetCP0Count() calls of the task and the one before it
+  cost = (PROBE_CALLS + 1) * host_cp0Step;
+  CHECK_EQ(prof[PROF_TASK + task].calls, sched_task[task].steps);
+  CHECK_EQ(prof[PROF_TASK + task].min, cost);
+  CHECK_EQ(prof[PROF_TASK + task].max, cost);
+  CHECK_EQ(prof[PROF_TASK + task].bins[31 - __builtin_clz(cost)], sched_task[task].steps);
+  for(i = 0; i < task; i++)
+    CHECK_EQ(prof[PROF_TASK + i].calls, sched_task[i].steps);
+  // one per round, prof_clear() started the first
+  CHECK_EQ(prof[PROF_LOOP].calls, sched_round);
+  CHECK(prof[PROF_RX].calls > 0);
+  CHECK(prof[PROF_RX].min <= prof[PROF_RX].max);
+
+  // the answer
+  steps = sched_task[task].steps;
+  CHECK(ask_profile(1, 0, "probe", &calls, &min, &avg, &max));
+  CHECK(calls >= steps);
+  CHECK_EQ(min, cost);
+  CHECK_EQ(avg, cost);
+  CHECK_EQ(max, cost);
+  CHECK(ask_profile(2, 0, "loop", &calls, &min, &avg, &max));
+  CHECK(min <= avg && avg <= max && calls > 0);
+
+  // cleared after the answer, the figures start over
+  CHECK(ask_profile(3, 1, "probe", &calls, &min, &avg, &max));
+  CHECK(calls > 0);
+  CHECK(prof[PROF_TASK + task].calls < calls);
+  CHECK(prof[PROF_TASK + task].calls < sched_task[task].steps);
+  return host_done(__FILE__);
+}
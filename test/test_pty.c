@@ -0,0 +1,126 @@
+// the device on a pseudo terminal and a host in a child process that sends
+// FRAMES frame packets, each one once the credit lets it. They are timed
+// FRAME_US apart, one at a time is due and the queue fills up. Credit means
+// room: no frame may take the place of another one.
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "host.h"
+#include USER_C
+
+#define FRAMES   40
+#define FRAME_US 25000		// a frame takes 10 ms on the wire
+#define PACKET_MAX (DL_HEADER + DL_PTS_BYTES + FRAME_PIXEL_BYTES + DL_TRAILER)
+
+// the next CREDIT from the device, its limit, -1 if there is none yet
+int read_credit(int fd) {
+  static u8 in[4096];
+  static u32 have;
+  u32 start, len;
+  ssize_t n;
+  u8 *p;
+
+  n = read(fd, in + have, sizeof(in) - have);
+  if(n > 0)
+    have += n;
+  for(;;) {
+    // text lines and other packets go by
+    for(start = 0; start + 4 <= have && memcmp(in + start, "LUMI", 4) != 0; start++)
+      ;
+    memmove(in, in + start, have - start);
+    have -= start;
+    if(have < DL_HEADER)
+      return -1;
+    len = DL_HEADER + (in[8] | (in[9] << 8)) + DL_TRAILER;
+    if(len > sizeof(in)) {
+      have = 0;
+      return -1;
+    }
+    if(have < len)
+      return -1;
+    p = in;
+    memmove(in, in + len, have - len);
+    have -= len;
+    if(p[4] == DL_T_CREDIT && host_crc32(p + 4, len - 8) == host_u32(p + len - 4))
+      return p[DL_HEADER] | (p[DL_HEADER + 1] << 8);
+  }
+}
+
+// the host: starts counting with an empty CREDIT, then frames 1 to FRAMES,
+// due from FRAME_US device clock on
+int host_side(const char *slave) {
+  static u8 frame[DL_PTS_BYTES + FRAME_PIXEL_BYTES], packet[PACKET_MAX];
+  struct termios tio;
+  int fd, credit, limit = -1;
+  u32 next = 1, len, waited = 0;
+
+  fd = open(slave, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0)
+    return 2;
+  tcgetattr(fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(fd, TCSANOW, &tio);
+  fcntl(fd, F_SETFL, 0);
+  len = host_frame(packet, DL_T_CREDIT, 0, 0, 0, 0);
+  if(write(fd, packet, len) != len)
+    return 3;
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+
+  while(next <= FRAMES) {
+    while((credit = read_credit(fd)) >= 0)
+      limit = credit;
+    if(limit < 0 || (s16)(limit - next) <= 0) {
+      if(++waited > 10000) {
+        printf("host: no credit for frame %u, limit %d\n", next, limit);
+        return 4;
+      }
+      usleep(1000);
+      continue;
+    }
+    memset(frame, next, sizeof(frame));
+    dl_put_u32(frame, next * FRAME_US);
+    len = host_frame(packet, DL_T_FRAME, DL_F_PTS, next, frame, sizeof(frame));
+    fcntl(fd, F_SETFL, 0);
+    if(write(fd, packet, len) != len)
+      return 5;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    next++;
+    waited = 0;
+  }
+  // until the device read it all
+  tcdrain(fd);
+  return 0;
+}
+
+int main() {
+  const char *slave;
+  pid_t child;
+  int status = -1;
+  u64 end;
+
+  host_reset();
+  setup();
+  slave = host_pty_open();
+  fflush(stdout);
+  child = fork();
+  if(child == 0)
+    _exit(host_side(slave));
+
+  while(waitpid(child, &status, WNOHANG) == 0)
+    host_pty_loop();
+  end = host_us() + 200000;
+  while(host_us() < end)
+    host_pty_loop();
+
+  CHECK(WIFEXITED(status));
+  CHECK_EQ(WEXITSTATUS(status), 0);
+  CHECK_EQ(dl_packets, FRAMES + 1);
+  CHECK_EQ(dl_crcErrors, 0);
+  CHECK_EQ(fb_received, FRAMES);
+  CHECK_EQ(fb_queueMax, FB_QUEUE);
+  CHECK_EQ(fb_superseded, 0);
+  CHECK_EQ(fb_dropped, 0);
+  CHECK_EQ(fb_swaps, FRAMES);
+  return host_done(__FILE__);
+}
@@ -0,0 +1,84 @@
+// RGB565 frames against the 24-bit path: every 565 color, expanded to 8 bit
+// per channel as a host does it, goes out in the wire format build
+// (rgb888) and as RGB565 (rgb565). The wire bytes the writers send of it,
+// build/rgb888.wire, have to be the same bit for bit.
+#include "host.h"
+#include USER_C
+
+#define COLORS 0x10000
+#define WIRE_FILE "build/rgb888.wire"
+
+u8 expand5(u32 c) {
+  return (c << 3) | (c >> 2);
+}
+
+u8 expand6(u32 c) {
+  return (c << 2) | (c >> 4);
+}
+
+int main() {
+  static u8 frame[FRAME_PIXEL_BYTES];
+  static u8 wire[COLORS / LEDS * LEDS * 3 + LEDS * 3];
+  u32 color, led, i, n = 0;
+  u16 id = 0;
+  FILE *file;
+
+  host_reset();
+  host_rxIrqOff = 1;
+  setup();
+
+  for(color = 0; color < COLORS; color += LEDS) {
+    for(led = 0; led < LEDS; led++) {
+      u32 c = (color + led) & 0xFFFF;
+#if FRAME_FORMAT == FRAME_RGB565
+      frame[2 * led] = c;
+      frame[2 * led + 1] = c >> 8;
+#else
+      // the wire keeps the top 7 bits
+      frame[3 * led] = expand5(c >> 11) >> 1;
+      frame[3 * led + 1] = expand6((c >> 5) & 0x3F) >> 1;
+      frame[3 * led + 2] = expand5(c & 0x1F) >> 1;
+#endif
+    }
+    host_send(DL_T_FRAME, 0, id++, frame, sizeof(frame));
+    do
+      dl_rx_poll();
+    while(dataLink_process() || host_rx_left() > 0);
+    // what the writers send of it
+    for(i = 0; i < LEDS * 3; i++)
+      wire[n++] = FB_WIRE_BYTE(frame_buff[fb_newest], i);
+  }
+  CHECK_EQ(fb_received, id);
+
+#if FRAME_FORMAT == FRAME_RGB565
+  {
+    static u8 expect[sizeof(wire)];
+    u32 bad = 0;
+
+    file = fopen(WIRE_FILE, "rb");
+    CHECK(file != 0);
+    if(file) {
+      CHECK_EQ(fread(expect, 1, sizeof(expect), file), n);
+      fclose(file);
+      for(i = 0; i < n; i++) {
+        if(wire[i] != expect[i] && bad++ < 4)
+          printf("wire byte %u: 0x%02x, the 24-bit path 0x%02x\n", i, wire[i], expect[i]);
+      }
+      CHECK_EQ(bad, 0);
+    }
+    // full scale stays full scale, black stays black
+    CHECK_EQ(fb_565_wire(0xFFFF, 0), 0xFF);
+    CHECK_EQ(fb_565_wire(0xFFFF, 1), 0xFF);
+    CHECK_EQ(fb_565_wire(0xFFFF, 2), 0xFF);
+    CHECK_EQ(fb_565_wire(0x0000, 1), 0x80);
+  }
+#else
+  file = fopen(WIRE_FILE, "wb");
+  CHECK(file != 0);
+  if(file) {
+    CHECK_EQ(fwrite(wire, 1, n, file), n);
+    fclose(file);
+  }
+#endif
+  return host_done(__FILE__);
+}
@@ -0,0 +1,108 @@
+// receive ring under load: a thread runs dl_rx_poll() as the interrupt does,
+// as fast as it can, while the loop drains the ring with dataLink_process().
+// Every frame has to come out whole and in order, packets (ring_framed), raw
+// pixels (ring_raw) and raw pixels into the back buffer (ring_direct).
+// DL_BARRIER() only stops the compiler, like on the single core PIC32 that
+// holds on hosts that keep stores in order (x86).
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "host.h"
+#include USER_C
+
+#define FRAMES 1000
+
+volatile u8 producerDone;
+volatile u8 consumerStalls;	// 1: the loop pauses now and then, the ring fills up
+
+void *producer(void *arg) {
+  u32 polls = 0;
+
+  while(host_rx_left() > 0) {
+    dl_rx_poll();
+    if((++polls & 0xFF) == 0)
+      sched_yield();
+  }
+  producerDone = 1;
+  return 0;
+}
+
+// frame k: every pixel byte the same value, a lost or extra byte mixes two
+u8 frame_value(u32 k) {
+  return (k * 13 + 1) & 0x7F;
+}
+
+int main() {
+  static u8 frame[FRAME_PIXEL_BYTES];
+  pthread_t thread;
+  u32 k, i, seen, sent = 0, bad = 0, idle = 0, loops = 0;
+  u8 *newest;
+
+#if !defined __x86_64__ && !defined __i386__
+  printf("%s: skipped, needs a host that keeps stores in order\n", __FILE__);
+  return 0;
+#endif
+  host_reset();
+  host_rxIrqOff = 1;
+  setup();
+
+  for(k = 0; k < FRAMES; k++) {
+    memset(frame, frame_value(k), sizeof(frame));
+#ifdef DL_FRAMED
+    host_send(DL_T_FRAME, 0, k, frame, sizeof(frame));
+    sent += DL_HEADER + sizeof(frame) + DL_TRAILER;
+#else
+    host_rx(frame, sizeof(frame));
+    sent += sizeof(frame);
+#endif
+  }
+
+  consumerStalls = 1;
+  pthread_create(&thread, 0, producer, 0);
+  seen = 0;
+  while(idle < 1000) {
+    if(dataLink_process())
+      idle = 0;
+    else if(producerDone)
+      idle++;
+    if(consumerStalls && (++loops % 64) == 0) {
+      usleep(200);
+      if(loops > 64 * 50)
+        consumerStalls = 0;
+    }
+
+    // the loop owns the newest frame, check each one as it comes
+    if(fb_received != seen) {
+      if(fb_received != seen + 1 && bad++ < 4)
+        printf("frames %u to %u came in one step\n", seen, fb_received);
+      seen = fb_received;
+      newest = frame_buff[fb_newest];
+      for(i = 0; i < FRAME_PIXEL_BYTES; i++) {
+        if(newest[i] != (frame_value(seen - 1) | 0x80)) {
+          if(bad++ < 4)
+            printf("frame %u byte %u: 0x%02x, expected 0x%02x\n",
+                   seen - 1, i, newest[i], frame_value(seen - 1) | 0x80);
+          break;
+        }
+      }
+    }
+  }
+  pthread_join(thread, 0);
+
+  CHECK_EQ(bad, 0);
+  CHECK_EQ(fb_received, FRAMES);
+  CHECK_EQ(host_rx_left(), 0);
+  CHECK_EQ(dl_ringHead, dl_ringTail);
+  CHECK_EQ(dl_bytesIn, sent);
+  // the stalls filled it, the endpoint held the rest back
+  CHECK(dl_ringOverflows > 0);
+  CHECK(dl_ringHighWater > DL_RING_SIZE - DL_PACKET);
+  CHECK(dl_ringHighWater <= DL_RING_SIZE);
+#ifdef DL_FRAMED
+  CHECK_EQ(dl_packets, FRAMES);
+  CHECK_EQ(dl_crcErrors, 0);
+  CHECK_EQ(dl_badHeaders, 0);
+  CHECK_EQ(dl_lostIds, 0);
+#endif
+  return host_done(__FILE__);
+}
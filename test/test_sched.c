@@ -0,0 +1,151 @@
+// the scheduler on the simulated clock, load scenarios replayed: no host,
+// a host that keeps the link full of frames, and the same with a task that
+// burns the CPU in steps of LOAD_STEP_US. A task with a deadline gets its
+// turn within the deadline and the step another task was in, the load still
+// gets its turns. With LW_STREAM a full stream queue takes nothing from the
+// ring and leaves the timeouts alone. A full task table leaves a task out.
+#include "host.h"
+#include USER_C
+
+#define SCENARIO_US    200000
+#define LOAD_STEP_US   100
+#define LOAD_BUDGET_US 300
+#define STEP_US        30	// the longest step of a task of the sketch, about
+
+u32 load_steps;
+
+// rotation math or the like, it always has more
+u8 load_process() {
+  u32 start = GetCP0Count();
+
+  while(GetCP0Count() - start < LOAD_STEP_US * Fcp0)
+    ;
+  load_steps++;
+  return 1;
+}
+
+void clear_stats() {
+  u8 i;
+
+  for(i = 0; i < sched_tasks; i++) {
+    sched_task[i].turns = 0;
+    sched_task[i].maxTurn = 0;
+    sched_task[i].maxWait = 0;
+    sched_task[i].misses = 0;
+  }
+  dl_ringOverflows = 0;
+}
+
+// run for us, with a host that sends the next frame as soon as the last one
+// is on its way when frames; the frames sent
+u32 replay(u32 us, u8 frames) {
+  static u8 frame[FRAME_PIXEL_BYTES];
+  static u16 id;
+  u64 end = host_us() + us;
+  u32 sent = 0;
+
+  while(host_us() < end) {
+    if(frames && host_rx_left() < DL_PACKET) {
+      memset(frame, id & 0x7F, sizeof(frame));
+      host_send(DL_T_FRAME, 0, id++, frame, sizeof(frame));
+      sent++;
+    }
+    host_loop();
+  }
+  // the last ones through
+  host_run_us(20000);
+  return sent;
+}
+
+void check_scenario(const char *name, u32 sent, u32 stepUs) {
+  schedTask *task;
+  u8 i;
+
+  printf("%-8s", name);
+  for(i = 0; i < sched_tasks; i++)
+    printf(" %s %u/%u", sched_task[i].name, sched_task[i].maxWait / Fcp0, sched_task[i].maxTurn / Fcp0);
+  printf(", max wait/turn us\n");
+
+  for(i = 0; i < sched_tasks; i++) {
+    task = &sched_task[i];
+    CHECK(task->turns > 0);
+    if(task->deadline && task->maxWait > task->deadline + stepUs * Fcp0) {
+      printf("%s: waited %u us, deadline %u us\n", task->name, task->maxWait / Fcp0, task->deadline / Fcp0);
+      host_failures++;
+    }
+    // a turn ends with the first step past the budget
+    if(task->budget && task->maxTurn > task->budget + stepUs * Fcp0) {
+      printf("%s: a turn of %u us, budget %u us\n", task->name, task->maxTurn / Fcp0, task->budget / Fcp0);
+      host_failures++;
+    }
+  }
+  CHECK_EQ(dl_ringOverflows, 0);
+  CHECK_EQ(dl_packets, sent);
+  CHECK_EQ(dl_crcErrors + dl_badHeaders + dl_timeouts, 0);
+  dl_packets = 0;
+}
+
+#ifdef LW_STREAM
+// a writer that doesn't keep up fills the stream queue: the dataLink takes
+// nothing, says so, and the timeouts run on
+void check_stall() {
+  static u8 frame[FRAME_PIXEL_BYTES];
+  u32 due, packetDue, pos;
+  u16 id;
+
+  host_spiCounts *= 1000;
+  memset(frame, 0x55, sizeof(frame));
+  for(id = 0; id < 4; id++)
+    host_send(DL_T_FRAME, 0, 0x1000 + id, frame, sizeof(frame));
+  while(lws_room() > 0 || dl_ringHead == dl_parsePos)
+    host_loop();
+  due = dataLink_timer.timer_due;
+  packetDue = dl_packetTimer.timer_due;
+  pos = dl_parsePos;
+  host_run_us(2 * TB_TICK_US);
+  CHECK(lws_room() == 0);
+  CHECK_EQ(dataLink_process(), 0);
+  CHECK_EQ(dl_parsePos, pos);
+  CHECK_EQ(dataLink_timer.timer_due, due);
+  CHECK_EQ(dl_packetTimer.timer_due, packetDue);
+}
+#endif
+
+int main() {
+  u32 sent;
+  u8 i;
+
+  host_reset();
+  setup();
+  host_run_us(1000);
+
+  clear_stats();
+  replay(SCENARIO_US, 0);
+  check_scenario("idle", 0, STEP_US);
+
+  clear_stats();
+  sent = replay(SCENARIO_US, 1);
+  CHECK(sent > 10);
+  check_scenario("frames", sent, STEP_US);
+
+  sched_add("load", load_process, 6, LOAD_BUDGET_US, 0);
+  clear_stats();
+  sent = replay(SCENARIO_US, 1);
+  check_scenario("load", sent, LOAD_STEP_US + STEP_US);
+  CHECK(load_steps > SCENARIO_US / LOAD_STEP_US / 4);
+
+#ifdef LW_STREAM
+  check_stall();
+#endif
+
+  // a full table leaves a task out and says so, the others stay
+  CHECK_EQ(sched_dropped, 0);
+  while(sched_tasks < SCHED_TASKS)
+    sched_add("more", load_process, 7, 0, 0);
+  sched_add("extra", load_process, 0, 0, 0);
+  CHECK_EQ(sched_tasks, SCHED_TASKS);
+  CHECK_EQ(sched_dropped, 1);
+  for(i = 0; i < sched_tasks; i++)
+    CHECK(strcmp(sched_task[i].name, "extra") != 0);
+  return host_done(__FILE__);
+}
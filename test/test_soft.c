@@ -0,0 +1,85 @@
+// the soft SPI writers at the pins: the LAT writes host.c records, decoded
+// as a strip sees them (the data bit at each rising clock edge), have to be
+// the wire bytes of the frame. The data and clock of pins 3/4 share a port,
+// pins 5/6 are on two. A pin on a port the chip doesn't have writes nowhere.
+#define _GNU_SOURCE		// memmem()
+#include "host.h"
+#include USER_C
+
+#define BYTES_MAX (HOST_LAT_MAX / 8)
+
+// the bytes a strip on data and clk took, the clock has to end low
+u32 decode(u8 dataPin, u8 clkPin, u8 *out) {
+  u32 lat[7] = { 0 };
+  u32 i, bits = 0, n = 0;
+  u8 clk = 0, b = 0;
+
+  CHECK(host_latWrites <= HOST_LAT_MAX);
+  for(i = 0; i < host_latWrites && i < HOST_LAT_MAX; i++) {
+    lat[host_latPort[i]] = host_latValue[i];
+    if((lat[portmask[clkPin]] & pinmask[clkPin]) == 0) {
+      clk = 0;
+      continue;
+    }
+    if(clk)
+      continue;
+    // rising edge
+    clk = 1;
+    b = (b << 1) | ((lat[portmask[dataPin]] & pinmask[dataPin]) != 0);
+    if(++bits % 8 == 0 && n < BYTES_MAX)
+      out[n++] = b;
+  }
+  CHECK_EQ(bits % 8, 0);
+  CHECK_EQ(clk, 0);
+  return n;
+}
+
+// the segment of the newest frame has to be in the bytes, whole
+void check_strip(const char *name, u8 dataPin, u8 clkPin, u32 segStart, u32 segEnd) {
+  static u8 bytes[BYTES_MAX], expect[LEDS * 3];
+  u32 n = decode(dataPin, clkPin, bytes), i;
+
+  for(i = segStart; i < segEnd; i++)
+    expect[i - segStart] = FB_WIRE_BYTE(frame_buff[fb_newest], i);
+  if(memmem(bytes, n, expect, segEnd - segStart) == 0) {
+    printf("%s: the frame isn't in the %u bytes clocked out\n", name, n);
+    host_failures++;
+  }
+}
+
+int main() {
+  static u8 frame[FRAME_PIXEL_BYTES];
+  volatile u32 *set, *clr;
+  u32 mask, i, sent34, sent56;
+
+  // data and clock on one port, and on two
+  portmask[3] = pD; pinmask[3] = 1 << 2;
+  portmask[4] = pD; pinmask[4] = 1 << 3;
+  portmask[5] = pE; pinmask[5] = 1 << 0;
+  portmask[6] = pB; pinmask[6] = 1 << 5;
+  portmask[7] = pA; pinmask[7] = 1 << 1;
+  portmask[8] = pG + 1; pinmask[8] = 1 << 4;
+
+  host_reset();
+  setup();
+  host_run_us(1000);
+
+  CHECK_EQ(lwn_port(7, &set, &clr, &mask), 1);
+  CHECK(set == &LATASET && clr == &LATACLR && mask == 1 << 1);
+  CHECK_EQ(lwn_port(8, &set, &clr, &mask), 0);
+  CHECK(set == &lwn_noPort && clr == &lwn_noPort && mask == 0);
+
+  for(i = 0; i < sizeof(frame); i++)
+    frame[i] = (i * 7 + 1) & 0x7F;
+  host_latWrites = 0;
+  sent34 = pin34Context.framesSent;
+  sent56 = pin56Context.framesSent;
+  host_send(DL_T_FRAME, 0, 0, frame, sizeof(frame));
+  // out whole: the one after it started
+  for(i = 0; i < 2000 && (pin34Context.framesSent < sent34 + 2 || pin56Context.framesSent < sent56 + 2); i++)
+    host_run_us(1000);
+  CHECK_EQ(fb_received, 1);
+  check_strip("pins 3/4", 3, 4, LWN34_SEG_FIRST * 3, (LWN34_SEG_FIRST + LWN34_SEG_LEDS) * 3);
+  check_strip("pins 5/6", 5, 6, LWN56_SEG_FIRST * 3, (LWN56_SEG_FIRST + LWN56_SEG_LEDS) * 3);
+  return host_done(__FILE__);
+}
@@ -0,0 +1,76 @@
+// DL_T_STATS: the two answers fit one packet each, the totals are the
+// counters they stand for, the rates the last STATS_MS of a host that sends
+// a frame every FRAME_MS.
+#include "host.h"
+#include USER_C
+
+#define FRAME_MS 20
+#define FRAMES   (2500 / FRAME_MS)
+
+u32 get_u32(const u8 *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+int main() {
+  static u8 frame[FRAME_PIXEL_BYTES], reply[DL_PACKET];
+  u32 total[STATS_COUNTERS], rate[STATS_COUNTERS], sent = 0, k;
+  u8 *payload = reply + DL_HEADER, answers = 0;
+  int len;
+
+  host_reset();
+  setup();
+  host_run_us(1000);
+
+  for(k = 0; k < FRAMES; k++) {
+    memset(frame, k & 0x7F, sizeof(frame));
+    host_send(DL_T_FRAME, 0, k, frame, sizeof(frame));
+    sent += DL_HEADER + sizeof(frame) + DL_TRAILER;
+    host_run_us(FRAME_MS * 1000);
+  }
+  while(host_packet(reply) > 0)
+    ;
+
+  host_send(DL_T_STATS, 0, k, 0, 0);
+  sent += DL_HEADER + DL_TRAILER;
+  host_run_us(FRAME_MS * 1000);
+  while((len = host_packet(reply)) > 0) {
+    if(reply[4] != DL_T_STATS)
+      continue;
+    CHECK_EQ(len, DL_HEADER + 2 + 4 * STATS_COUNTERS + DL_TRAILER);
+    CHECK(len <= DL_PACKET);
+    CHECK_EQ(payload[1], STATS_COUNTERS);
+    for(k = 0; k < STATS_COUNTERS; k++) {
+      if(payload[0] == 0)
+        total[k] = get_u32(payload + 2 + 4 * k);
+      else
+        rate[k] = get_u32(payload + 2 + 4 * k);
+    }
+    answers |= 1 << payload[0];
+  }
+  CHECK_EQ(answers, 3);
+
+  CHECK_EQ(total[STATS_FRAMES], FRAMES);
+  CHECK_EQ(total[STATS_FRAMES], fb_received);
+  CHECK_EQ(total[STATS_SWAPS], fb_swaps);
+  CHECK_EQ(total[STATS_BYTES_IN], sent);
+  CHECK_EQ(total[STATS_TIMEOUTS] + total[STATS_OVERFLOWS], 0);
+  // every frame started, and refreshes of the one that stays
+  CHECK(total[STATS_SPI] >= total[STATS_SWAPS]);
+  CHECK(total[STATS_SPI] <= lw_framesSent);
+#ifdef PARALLEL_SPI
+  CHECK(total[STATS_PARALLEL] >= total[STATS_SWAPS] && total[STATS_PARALLEL] <= lwp_framesSent);
+#else
+  CHECK_EQ(total[STATS_PARALLEL], 0);
+#endif
+#ifdef SOFT_SPI
+  CHECK(total[STATS_PIN34] >= total[STATS_SWAPS] && total[STATS_PIN34] <= pin34Context.framesSent);
+  CHECK(total[STATS_PIN56] >= total[STATS_SWAPS] && total[STATS_PIN56] <= pin56Context.framesSent);
+#else
+  CHECK_EQ(total[STATS_PIN34] + total[STATS_PIN56], 0);
+#endif
+
+  CHECK(rate[STATS_FRAMES] + 1 >= 1000 / FRAME_MS && rate[STATS_FRAMES] <= 1000 / FRAME_MS + 1);
+  k = DL_HEADER + sizeof(frame) + DL_TRAILER;
+  CHECK(rate[STATS_BYTES_IN] + k >= k * (1000 / FRAME_MS) && rate[STATS_BYTES_IN] <= k * (1000 / FRAME_MS + 1));
+  return host_done(__FILE__);
+}
@@ -0,0 +1,116 @@
+// the time base and the timer wheel: time_us() over the CP0 count wrap, a
+// tick that comes in time_us() after it read the count, timers that fire
+// on their tick, past a round of the wheel and over the tick count wrap.
+#include "host.h"
+#include USER_C
+
+#define STEP_US 100
+#define NEVER   0xFFFFFFFF
+
+u8 race;
+
+// the time base interrupt right after the next GetCP0Count()
+void race_hook() {
+  if(!race)
+    return;
+  race = 0;
+  host_intFlag[INT_TIMER4] = 1;
+  Tmr4Interrupt();
+}
+
+// run until the timer fires, us it took; NEVER if it didn't within us
+u32 fire_us(timerContext *timer, u32 us) {
+  u64 start = host_us();
+
+  while(host_us() - start < us) {
+    host_run_us(STEP_US);
+    if(check_timer(timer))
+      return host_us() - start;
+  }
+  return NEVER;
+}
+
+// a timer of ms fires within a tick of it, once
+void check_fires(timerContext *timer, u32 ms) {
+  u32 us;
+
+  start_ms_timer(timer, ms);
+  us = fire_us(timer, ms * 1000 + 2 * TB_TICK_US);
+  CHECK(us + TB_TICK_US + STEP_US >= ms * 1000 && us <= ms * 1000 + STEP_US);
+  CHECK_EQ(check_timer(timer), 0);
+}
+
+// a repeating timer of ms keeps to its first due tick: no drift from the loop
+void check_repeat(timerContext *timer, u32 ms, u32 rounds) {
+  u64 start = host_us();
+  u32 k, us = 0;
+
+  start_ms_timer(timer, ms);
+  for(k = 0; k < rounds; k++) {
+    us = fire_us(timer, ms * 1000 + 2 * TB_TICK_US);
+    CHECK(us != NEVER);
+    repeat_ms_timer(timer, ms);
+  }
+  us = host_us() - start;
+  CHECK(us + TB_TICK_US + STEP_US >= rounds * ms * 1000 && us <= rounds * ms * 1000 + STEP_US);
+  stop_timer(timer);
+}
+
+int main() {
+  timerContext timer;
+  u64 last, t, offset;
+  u32 k, before, count;
+
+  // the count wraps 5 ms after setup
+  host_cp0 = 0xFFFFFFFF - 5000 * (HOST_CP0_HZ / 1000000);
+  host_reset();
+  setup();
+  offset = host_us() - time_us();
+  last = 0;
+  for(k = 0; k < 200; k++) {
+    host_run_us(STEP_US);
+    t = time_us();
+    CHECK(t >= last);
+    CHECK(host_us() - t - offset <= 2);
+    last = t;
+  }
+  CHECK((s32)host_cp0 > 0);
+  CHECK_EQ(tb_ticks, 20);
+
+  // timers
+  memset(&timer, 0, sizeof(timer));
+  check_fires(&timer, 5);
+  check_fires(&timer, 3 * TW_SLOTS + 7);
+  start_ms_timer(&timer, 5);
+  stop_timer(&timer);
+  CHECK_EQ(fire_us(&timer, 10000), NEVER);
+  check_repeat(&timer, 10, 50);
+
+  // the tick count wraps
+  host_run_us(STEP_US);
+  tb_ticks = tw_tick = 0xFFFFFFF8;
+  check_fires(&timer, 20);
+  CHECK(tb_ticks < 100);
+  tb_ticks = tw_tick = 0xFFFFFFF8;
+  check_repeat(&timer, 3, 10);
+
+  // the tick comes in time_us() after the count was read: the tick is due 4
+  // counts on, the interrupt reads the count after that
+  count = tb_tickCount;
+  while((s32)(count - host_cp0) < 4 + (s32)host_cp0Step)
+    count += tb_tickCounts;
+  host_cp0 = count - 4;
+  before = tb_ticks;
+  host_cp0Hook = race_hook;
+  race = 1;
+  t = time_us();
+  CHECK_EQ(race, 0);
+  CHECK(tb_ticks != before);
+  CHECK_EQ(tb_tickCount, count);
+  last = time_us();
+  CHECK(last >= t && last - t <= 2);
+  // a count from before the last tick is the tick
+  CHECK_EQ(tb_us_at(count - 4), tb_tickUs);
+  CHECK_EQ(tb_us_at(count + 40 * Fcp0), tb_tickUs + 40);
+  return host_done(__FILE__);
+}
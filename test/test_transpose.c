@@ -0,0 +1,89 @@
+// parallel soft SPI: lwp_transpose8() bit for bit against a plain bit
+// loop, and the port bits lwp_bit_planes() makes of the strips' bytes
+#include "host.h"
+#include USER_C
+
+#define ROUNDS 100000
+
+// out[k] bit s = in[s * stride] bit 7 - k
+void transpose_bits(const u8 *in, u32 stride, u8 *out) {
+  u8 k, s;
+
+  for(k = 0; k < 8; k++) {
+    out[k] = 0;
+    for(s = 0; s < 8; s++)
+      out[k] |= ((in[s * stride] >> (7 - k)) & 1) << s;
+  }
+}
+
+u32 rand_state = 12345;
+
+u8 rand8() {
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 16;
+}
+
+void check_transpose() {
+  static const u32 strides[] = { 1, 3, LWP_STRIP_BYTES };
+  u8 in[8 * LWP_STRIP_BYTES];
+  u8 out[8], expect[8], inPlace[8];
+  u32 r, i, stride, bad = 0;
+
+  for(r = 0; r < ROUNDS; r++) {
+    stride = strides[r % 3];
+    for(i = 0; i < 8; i++)
+      in[i * stride] = rand8();
+    // the corners: all set, all clear, one bit
+    if(r < 8)
+      for(i = 0; i < 8; i++)
+        in[i * stride] = (r == 0) ? 0xFF : (r == 1) ? 0x00 : (i == r) ? 1 << (r - 2) : 0;
+    lwp_transpose8(in, stride, out);
+    transpose_bits(in, stride, expect);
+    if(memcmp(out, expect, 8) != 0 && bad++ < 4)
+      printf("round %u stride %u: transposed wrong\n", r, stride);
+
+    // lwp_bit_planes() transposes its own copy in place
+    if(stride == 1) {
+      memcpy(inPlace, in, 8);
+      lwp_transpose8(inPlace, 1, inPlace);
+      if(memcmp(inPlace, expect, 8) != 0 && bad++ < 4)
+        printf("round %u: in place transposed wrong\n", r);
+    }
+  }
+  CHECK_EQ(bad, 0);
+}
+
+// plane k has strip s's bit 7 - k at port bit LWP_DATA_SHIFT + s
+void check_bit_planes() {
+  u8 *frame = frame_buff[0];
+  u32 planes[8];
+  u32 r, index, k, s, expect, bad = 0;
+
+  for(r = 0; r < ROUNDS / 10; r++) {
+    for(k = 0; k < FRAME_PIXEL_BYTES; k += 97)
+      frame[k] = rand8();
+    index = LWP_SEG_FIRST * 3 + (r * 7) % LWP_STRIP_BYTES;
+    for(s = 0; s < LWP_STRIPS; s++)
+      frame[s * LWP_STRIP_BYTES + index] = rand8() | 0x80;
+    lwp_bit_planes(frame, index, planes);
+    for(k = 0; k < 8; k++) {
+      expect = 0;
+      for(s = 0; s < LWP_STRIPS; s++)
+        expect |= (u32)((FB_WIRE_BYTE(frame, s * LWP_STRIP_BYTES + index) >> (7 - k)) & 1) << (LWP_DATA_SHIFT + s);
+      if(planes[k] != expect && bad++ < 4)
+        printf("index %u plane %u: 0x%x, expected 0x%x\n", index, k, planes[k], expect);
+      if(planes[k] & ~LWP_DATA_MASK)
+        bad++;
+    }
+  }
+  CHECK_EQ(bad, 0);
+}
+
+int main() {
+  host_reset();
+  setup();
+
+  check_transpose();
+  check_bit_planes();
+  return host_done(__FILE__);
+}
@@ -0,0 +1,140 @@
+// hardware SPI writer: setup, the wire stream of frames and the writer
+// states, the same with DMA (writer_dma), the TX FIFO interrupt
+// (writer_fifo) and byte by byte from the loop (writer_poll)
+#include "host.h"
+#include USER_C
+
+#define RED   0x11
+#define GREEN 0x22
+#define BLUE  0x33
+
+u8 frame[FRAME_PIXEL_BYTES];
+u16 frameId;
+
+void send_frame() {
+  host_send(DL_T_FRAME, 0, frameId++, frame, sizeof(frame));
+}
+
+// the bytes the SPI shifted out since mark, compared with the wire stream of
+// LEDs [0, leds) of the frame taken from wire and their latch zeros
+void check_stream(u32 mark, const u8 *wire, u32 leds) {
+  u32 n = leds * 3 + ZEROS_FOR(leds);
+  u32 i, bad = 0;
+
+  CHECK_EQ(host_spiBytes - mark, n);
+  for(i = 0; i < n && mark + i < host_spiBytes; i++) {
+    u8 expect = (i < leds * 3) ? wire[i] : 0x00;
+    if(host_spiOut[mark + i] != expect && bad++ < 4)
+      printf("byte %u: 0x%02x, expected 0x%02x\n", i, host_spiOut[mark + i], expect);
+  }
+  CHECK_EQ(bad, 0);
+}
+
+// run for 30 ms, a frame takes about 6, and note the states the writer goes through
+u32 run_states(u8 *states, u32 max) {
+  u64 end = host_us() + 30000;
+  u32 n = 0;
+  u8 last = 0;
+
+  while(host_us() < end) {
+    host_loop();
+    if(lw_state != last) {
+      last = lw_state;
+      states[n % max] = last;
+      n++;
+    }
+  }
+  return n < max ? n : max;
+}
+
+int main() {
+  static u8 wire[LEDS * 3];
+  u8 states[16];
+  u32 mark, n, i, pos;
+
+  host_reset();
+  setup();
+
+#ifdef LW_USE_DMA
+  // channel 0 goes from the frame to SPI2BUF on the SPI TX event
+  CHECK(DMACON & LW_DMA_DMAON);
+  CHECK_EQ((DCH0ECON >> 8) & 0xFF, LW_DMA_IRQ);
+  CHECK(DCH0ECON & LW_DMA_SIRQEN);
+  CHECK_EQ(DCH0DSA, (uintptr_t)&SPI2BUF);
+  CHECK_EQ(DCH0DSIZ, 1);
+  CHECK_EQ(DCH0CSIZ, 1);
+#endif
+#ifdef LW_USE_FIFO
+  CHECK(SPI2CON & LW_SPI_ENHBUF);
+  CHECK(SPI2CON & LW_SPI_ON);
+#endif
+
+  // wake up latch, then the blank frame the slots start with
+  n = run_states(states, sizeof(states));
+  memset(wire, 0x80, sizeof(wire));
+  mark = ZEROS_FOR(LW_SEG_LEDS);
+#ifndef LW_USE_DMA
+#ifndef LW_USE_FIFO
+  mark++;			// the 0x00 lw_spi_setup() writes to get STATRX going
+#endif
+#endif
+  CHECK(host_spiBytes >= mark);
+  for(i = 0; i < mark; i++)
+    CHECK_EQ(host_spiOut[i], 0x00);
+  check_stream(mark, wire, LEDS);
+  CHECK_EQ(lw_framesSent, 1);
+
+  // a frame of one color: GRB on the wire, high bit set
+  for(i = 0; i < LEDS; i++) {
+    frame[3 * i] = RED;
+    frame[3 * i + 1] = GREEN;
+    frame[3 * i + 2] = BLUE;
+    wire[3 * i] = GREEN | 0x80;
+    wire[3 * i + 1] = RED | 0x80;
+    wire[3 * i + 2] = BLUE | 0x80;
+  }
+  mark = host_spiBytes;
+  send_frame();
+  n = run_states(states, sizeof(states));
+  check_stream(mark, wire, LEDS);
+  CHECK_EQ(lw_framesSent, 2);
+  CHECK_EQ(fb_received, 1);
+  // pixels, latch zeros, then waiting (the last ones noted)
+  CHECK(n >= 3 && n < sizeof(states));
+  if(n >= 3) {
+    CHECK_EQ(states[n - 3], LW_S_WAIT_TO_WRITE_PIXEL);
+    CHECK_EQ(states[n - 2], LW_S_WAIT_TO_WRITE_ZEROS);
+    CHECK_EQ(states[n - 1], LW_S_WAIT_FOR_FRAME);
+  }
+#ifdef LW_USE_DMA
+  // the pixels in blocks of LW_DMA_BLOCK, then the zeros
+  CHECK(host_dmaBlocks >= (LEDS * 3 + LW_DMA_BLOCK - 1) / LW_DMA_BLOCK + 1);
+  CHECK(!(DCH0CON & LW_DMA_CHEN));
+#endif
+#ifdef LW_USE_FIFO
+  CHECK(host_spiIrqs > 0);
+  CHECK(!(IEC1 & LW_FIFO_BIT));
+#endif
+
+  // the same frame again: nothing goes out
+  mark = host_spiBytes;
+  send_frame();
+  run_states(states, sizeof(states));
+  CHECK_EQ(host_spiBytes, mark);
+
+  // one pixel changes: only the chain up to it goes out, with its latch
+  pos = dl_map[0];
+  frame[0] = 0x7F;
+  wire[3 * pos + 1] = 0xFF;
+  mark = host_spiBytes;
+  send_frame();
+  run_states(states, sizeof(states));
+  check_stream(mark, wire, pos + 1);
+
+  // the keepalive sends the whole frame again
+  mark = host_spiBytes;
+  host_run_us(LW_KEEPALIVE_MS * 1000 + 20000);
+  check_stream(mark, wire, LEDS);
+
+  return host_done(__FILE__);
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# user.c with its compile time switches changed, for one host test:
+#   variant.sh +NAME ... -NAME ... NAME=VALUE ... < user.c > variant.c
+# +NAME comments "#define NAME" in, -NAME comments it out, NAME=VALUE sets
+# the value of "#define NAME". A switch that isn't there is an error, so a
+# renamed one doesn't go unnoticed.
+script=
+names=
+for opt in "$@"; do
+  case $opt in
+  +*) name=${opt#?}; script="$script;s|^//[ ]*#define $name\\b|#define $name|" ;;
+  -*) name=${opt#?}; script="$script;s|^#define $name\\b|//#define $name|" ;;
+  *=*) name=${opt%%=*}; script="$script;s|^\\(#define $name[ \\t]*\\)[^ \\t]*|\\1${opt#*=}|" ;;
+  *) echo "variant.sh: $opt is neither +NAME, -NAME nor NAME=VALUE" >&2; exit 1 ;;
+  esac
+  names="$names $name"
+done
+tmp=$(mktemp)
+trap 'rm -f "$tmp"' EXIT
+cat > "$tmp"
+for name in $names; do
+  if ! grep -q "^/*[ ]*#define $name\\b" "$tmp"; then
+    echo "variant.sh: user.c has no switch $name" >&2
+    exit 1
+  fi
+done
+sed -e "${script#;}" "$tmp"
@@ -3,11 +3,58 @@
  * Author: Erich Buri <erich.buri@gmail.com>
  *
  * - Uses different buffers for animator and LED-Strip-Writer
- * - Uses common functions for the timer-stuff
+ * - Uses common functions for the timer-stuff: a timer interrupt extends
+ *   CP0 Count to a 64 bit us time base, the ms timers sit on a timer wheel
+ *   and run out on their tick, however slow the loop is
  * - Implements SPI-Emulation on multiple ports:
  *   - soft SPI 1: Pin 3 data, Pin 4 clock
  *   - soft SPI 2: Pin 5 data, Pin 6 clock
+ *   whole bytes at a time through the LAT SET/CLR registers, as many as
+ *   fit into LWN_BUDGET_US per turn
  * - Adds cdc to change data
+ * - Replies and messages to the host go into a transmit ring a task hands
+ *   to USB as it gets ready, the loop never waits for the host; what
+ *   doesn't fit is dropped and counted
+ * - Optionally streams the frame to the SPI through DMA (LW_USE_DMA), or
+ *   tops up the SPI's TX FIFO from its interrupt (LW_USE_FIFO)
+ * - Frames are stored in LPD8806 wire format (GRB, high bit set, latch
+ *   zeros appended), so the writers only copy bytes
+ * - Triple buffering: writers pick up the newest complete frame only at
+ *   their latch boundary, the dataLink never waits for them
+ * - Refresh-on-change: a frame goes out once, then the writers idle until
+ *   the next one arrives (LW_REFRESH_ON_CHANGE)
+ * - Partial refresh: a new frame only clocks out the chain up to its last
+ *   changed pixel, followed by the latch zeros for that prefix
+ * - Parallel soft SPI: the chain split over up to 16 strips, their data
+ *   lines on one port and a shared clock, all written at once (PARALLEL_SPI)
+ * - Segments: every output drives its own part of the chain with its own
+ *   latch, so several outputs share the work of one frame
+ * - CDC data is received from a timer interrupt into a ring buffer, the
+ *   loop drains it in batches
+ * - Rotation/serpentine mapping runs on a lookup table the host can change
+ *   at runtime, a host that sends wire order (RAW_LAYOUT) is received
+ *   straight into the back buffer
+ * - Framed dataLink (DL_FRAMED): packets with magic, id, length and CRC-32,
+ *   corrupt frames are dropped and the parser resyncs on the next header
+ * - Flow control by credits, run length and delta coded frames
+ * - Palette mode (FRAME_INDEXED): one byte per LED in RAM and over USB, the
+ *   writers look the wire bytes up as they go
+ * - RGB565 mode (FRAME_RGB565): two bytes per LED, expanded to 7 bit per
+ *   color by the writers
+ * - Frame queue: the host can put a presentation time on a frame, the
+ *   writers show it when the device clock gets there (DL_F_PTS)
+ * - Output API: producers acquire and present buffers and get a fence that
+ *   tells when the frame is latched, optionally the host gets told, too
+ * - Cooperative scheduler: the writers and the dataLink are tasks with a
+ *   priority, a budget per turn and a deadline, so a busy dataLink can't
+ *   starve the output
+ * - Profiler (PROFILE): CP0 cycles of every task step, the loop period and
+ *   the receive interrupt, min/avg/max and log2 histograms for the host
+ * - Statistics: frames in, shown, superseded and dropped, bytes both ways,
+ *   timeouts, ring overflows and the frames every output started, as totals
+ *   and per second rates the host can poll
+ * - Cut-through (LW_STREAM): frames go on to the SPI as they come in, no
+ *   frame buffers, so the chain isn't bounded by RAM
  */
 #define DEBUG_MODE NODEBUG
 #include <stdlib.h>
@@ -16,26 +63,83 @@
 #include <delay.c>
 #include <spi.c>
 #include <__cdc.c>
+#define TMR4INT		// Tmr4Interrupt() below keeps the time base going
+#define TMR5INT		// Tmr5Interrupt() below feeds the dataLink receive ring
+#define SPI2INT		// SPI2Interrupt() below refills the SPI TX FIFO (LW_USE_FIFO)
+#include <interrupt.c>
 
 //////////////////////////////////////////////////////////////////////////////////
 // TYPES
 //////////////////////////////////////////////////////////////////////////////////
+#define PROF_BINS 20	// bin k counts calls of [2^k, 2^(k+1)) CP0 counts, the last one all longer
+
 typedef struct _timerContext {
-  u32 timer_start;	// us-counter-start
-  u32 timer_stop;		// us-counter-stop
-  u32 timer_delay;	// ms-delay
+  struct _timerContext *timer_next;	// in its wheel slot
+  struct _timerContext **timer_link;	// the pointer to it, to unlink it at once
+  u32 timer_due;	// tick it runs out at
+  u8 timer_state;	// TW_*
 } timerContext;
 
+// frame fence, and all frames before it, are latched by every writer
+typedef void (*fbLatchedHandler)(u32 fence);
+// a presented frame left the queue, there is room for another one
+typedef void (*fbFreeHandler)(void);
+
+// one step of a task, returns 1 if another step may do more right away
+typedef u8 (*schedRun)(void);
+
+typedef struct _schedTask {
+  const char *name;
+  schedRun run;
+  u8 priority;          // 0 goes first
+  u32 budget;           // CP0 counts a turn may take, 0 = one step
+  u32 deadline;         // CP0 counts from turn to turn at most, 0 = none
+  u32 turnStart;        // CP0 count the last turn started at
+  u32 round;            // sched_round of the last turn
+  u32 turns;
+  u32 steps;
+  u32 counts;           // CP0 counts spent in turns, wraps
+  u32 maxTurn;          // longest turn
+  u32 maxWait;          // longest time from turn to turn
+  u32 misses;           // turns that came after the deadline
+} schedTask;
+
+typedef struct _profProbe {
+  u32 calls;
+  u32 min;              // CP0 counts
+  u32 max;
+  u64 sum;
+  u32 bins[PROF_BINS];  // log2 histogram, see PROF_BINS
+} profProbe;
+
 typedef struct _lwnContext {
   u8 data_pin;
   u8 clk_pin;
+  volatile u32 *dataSet; // LATxSET/LATxCLR and bit of the pins, looked up once
+  volatile u32 *dataClr;
+  u32 dataMask;
+  volatile u32 *clkSet;
+  volatile u32 *clkClr;
+  u32 clkMask;
+  u8 writer;            // FB_W_*
   u8 state;
-  u8 sub_state;
+  u8 slot;              // frame slot being drawn
+  u32 seq;              // frame number the strip shows
+  u32 segStart;         // first byte of the segment this strip shows
+  u32 segEnd;           // end of that segment
   u32 pixelIndex;
-  u32 zeroCounter;
-  u8 bitmask;
+  u32 spanEnd;          // end of the pixel or zero run being written
+  u32 framesSent;
+  timerContext keepalive;
 } lwnContext;
 
+typedef struct _dlGeometry {
+  u16 width;            // LEDs per row of the panel, the chain runs row by row
+  u16 height;           // rows
+  u8 rotation;          // quarters the host's image is turned clockwise
+  u8 flags;             // DL_G_*
+} dlGeometry;
+
 //////////////////////////////////////////////////////////////////////////////////
 // CONSTS & VARIABLES
 //////////////////////////////////////////////////////////////////////////////////
@@ -44,20 +148,367 @@ typedef struct _lwnContext {
 #define L_WIDTH 32
 #define L_HEIGHT 32
 #define LEDS ( L_WIDTH * L_HEIGHT )
-#define ZEROS_NEEDED (3 * ((LEDS + 63) / 64))
+#define ZEROS_FOR(leds) (3 * (((leds) + 63) / 64))	// latch zeros for a chain of leds
+#define ZEROS_NEEDED ZEROS_FOR(LEDS)
+
+// Frame format
+// FRAME_WIRE keeps frames as they go on the wire, the writers only copy bytes.
+// FRAME_INDEXED keeps one palette index per LED: a third of the RAM and of the
+// USB traffic, the writers look the wire bytes up as they go.
+// FRAME_RGB565 keeps the colors the host sends as RGB565, the writers expand
+// them to the 7 bits per color LPD8806 takes.
+// The compact formats leave room for bigger panels in the same RAM.
+#define FRAME_WIRE    1
+#define FRAME_INDEXED 2
+#define FRAME_RGB565  3
+#define FRAME_FORMAT FRAME_WIRE
+
+#if FRAME_FORMAT == FRAME_INDEXED
+#define FB_LED_BYTES 1
+#define FRAME_BYTES LEDS
+#elif FRAME_FORMAT == FRAME_RGB565
+#define FB_LED_BYTES 2		// little endian, red in the top bits
+#define FRAME_BYTES (LEDS * 2)
+#else
+#define FB_LED_BYTES 3
+#define FRAME_BYTES (LEDS * 3 + ZEROS_NEEDED)	// pixels + latch, as they go on the wire
+#endif
+#define FRAME_PIXEL_BYTES (LEDS * FB_LED_BYTES)	// the part of a frame the host sends
 
 u8 Fcp0;				// number of GetCP0Count()'s for one microsecond
-u8 pixel_buff_one[LEDS * 3];    // Two buffer's. One of them is currently drawn,
-u8 pixel_buff_two[LEDS * 3];	// the other can be edited
+
+// Time base
+// Tmr4Interrupt() counts the ticks off CP0 Count. It runs at least once a
+// tick, far more often than Count wraps (107 s at 80 MHz).
+#define TB_TICK_US 1000		// one timer wheel tick
+#define TB_IPL     6		// nothing reads the time base while it moves
+volatile u32 tb_ticks;		// ticks since setup, written last
+volatile u32 tb_tickCount;	// CP0 count of the last tick
+volatile u64 tb_tickUs;		// us of the last tick
+u32 tb_tickCounts;		// CP0 counts of one tick
+u32 clk_offset;			// device clock minus time base, the host may set it
+
+// Timer wheel
+// An armed timer hangs in the slot of its due tick, the wheel looks at one
+// slot per tick, so starting, stopping and running out are O(1).
+#define TW_SLOTS 64		// power of two, timers due further out wait for a later round
+#define TW_IDLE  0
+#define TW_ARMED 1		// on the wheel
+#define TW_FIRED 2		// ran out, check_timer() hasn't seen it yet
+timerContext *tw_slot[TW_SLOTS];
+u32 tw_tick;			// the wheel is done with the ticks up to this one
+
+// Scheduler
+// loop() gives every task a turn, highest priority first. A turn takes steps
+// until the task has nothing to do or its budget is used up. Tasks past their
+// deadline get their turn first and cut the turn of a less important one short.
+#define SCHED_TASKS    8
+#define LW_TURN_US     20	// hardware SPI writer
+#define LW_DEADLINE_US 150	// a DMA block of 256 bytes lasts 205 us at 10 MHz
+#define LWP_TURN_US    20	// parallel soft SPI writer
+#define DL_TURN_US     200	// dataLink
+#define DL_DEADLINE_US 2000	// the ring holds about 4 ms of full speed USB
+schedTask sched_task[SCHED_TASKS];	// in priority order
+u8  sched_tasks;
+u8  sched_dropped;		// tasks sched_add() had no room for, raise SCHED_TASKS
+u32 sched_round;		// rounds, one per loop()
+
+// Profiler
+// Comment in to count the CP0 cycles of every scheduler step, the loop period
+// and the receive interrupt. The host gets them with DL_T_PROFILE.
+//#define PROFILE
+
+#define PROF_LOOP   0		// from round to round
+#define PROF_RX     1		// Tmr5Interrupt()
+#define PROF_TASK   2		// the steps of sched_task[i] are probe PROF_TASK + i
+#define PROF_PROBES (PROF_TASK + SCHED_TASKS)
+
+#ifdef PROFILE
+#define PROF_ADD(probe, counts) prof_add(&prof[probe], counts)
+profProbe prof[PROF_PROBES];
+u32 prof_roundStart;		// CP0 count the last round started at
+#else
+#define PROF_ADD(probe, counts)
+#endif
+
+// Statistics
+// Totals of the counters below and their rates over the last STATS_MS, the
+// host polls them with DL_T_STATS.
+#define STATS_MS        1000
+#define STATS_FRAMES    0	// complete frames from the dataLink
+#define STATS_SWAPS     1	// frames that became the one the writers show
+#define STATS_SUPERSEDED 2	// frames a newer one took the place of
+#define STATS_DROPPED   3	// frames thrown away, no slot or late
+#define STATS_BYTES_IN  4	// bytes from the host
+#define STATS_BYTES_OUT 5	// bytes of the replies to the host
+#define STATS_TIMEOUTS  6	// partial frames or packets DATA_LINK_TIMEOUT threw away
+#define STATS_OVERFLOWS 7	// receive polls that found the ring full
+#define STATS_SPI       8	// frames each output started, a refresh of the same one too, 0 for the ones not built in
+#define STATS_PARALLEL  9
+#define STATS_PIN34     10
+#define STATS_PIN56     11
+#define STATS_COUNTERS  12
+
+timerContext stats_timer;
+u64 stats_lastUs;		// time base of the last sample
+u32 stats_last[STATS_COUNTERS];	// totals of the last sample
+u32 stats_rate[STATS_COUNTERS];	// per second, from the last two samples
+
+// Comment in to mirror the frame on the soft SPI ports, too
+//#define SOFT_SPI
+// Comment in to drive the chain as LWP_STRIPS parallel strips, too
+//#define PARALLEL_SPI
+// Comment in to pass the frames on to the hardware SPI as they come in, the
+// latch right after the last LED (cut-through). There are no frame buffers:
+// the host sends the LEDs in chain order, and the chain may be longer than
+// the frame buffers would allow.
+//#define LW_STREAM
+
+#if defined LW_STREAM && (FRAME_FORMAT != FRAME_WIRE || defined SOFT_SPI || defined PARALLEL_SPI)
+#error "LW_STREAM takes FRAME_WIRE frames to the hardware SPI only"
+#endif
+
+// the tasks setup() registers: timers, spi, dataLink, cdcTx, stats and the writers switched in
+#if 5 + 2 * defined(SOFT_SPI) + defined(PARALLEL_SPI) > SCHED_TASKS
+#error "setup() registers more tasks than SCHED_TASKS has room for"
+#endif
+
+// Frame buffers
+// One is filled by the dataLink, FB_QUEUE hold complete frames until a writer
+// picks them up and one is on the wire per writer. Writers only switch
+// frames at their latch boundary, so a frame is never latched half old, half new.
+#ifndef LW_STREAM
+#ifdef SOFT_SPI
+#define LWN_WRITERS 2	// the soft SPI writers draw at their own pace
+#else
+#define LWN_WRITERS 0
+#endif
+#ifdef PARALLEL_SPI
+#define LWP_WRITERS 1
+#else
+#define LWP_WRITERS 0
+#endif
+
+// Frame queue
+// Complete frames wait in the order they came in until they are due: at once,
+// or when the device clock gets to the presentation time the host put on them.
+// At its latch boundary a writer takes the newest frame that is due, the ones
+// queued before it are skipped.
+#if FRAME_FORMAT == FRAME_WIRE && LWN_WRITERS + LWP_WRITERS >= 2
+#define FB_QUEUE   1		// the slow writers in wire format leave room for one, see RAM_BUDGET
+#else
+#define FB_QUEUE   2		// frames that may wait, 1 only keeps the newest
+#endif
+#define FB_LATE_US 2000		// a frame taken longer than this after its time is late
+// Comment in to throw late frames away, the strip keeps the frame before
+//#define FB_LATE_DROP
+
+#define FRAME_SLOTS (2 + FB_QUEUE + LWN_WRITERS + LWP_WRITERS)
+#define FB_WRITERS  (1 + LWN_WRITERS + LWP_WRITERS)
+#define FB_W_SPI      0		// writer numbers, for fb_latch()
+#define FB_W_PIN34    1
+#define FB_W_PIN56    2
+#define FB_W_PARALLEL (1 + LWN_WRITERS)
+#define FB_NONE 0xFF
+#define FB_SEQ_NONE 0xFFFFFFFF
+
+u8  frame_buff[FRAME_SLOTS][FRAME_BYTES] __attribute__((aligned(4)));
+u8  fb_users[FRAME_SLOTS];	// number of writers drawing a slot
+u8  fb_back;			// slot the dataLink is filling
+u8  fb_queue[FB_QUEUE];		// complete frames no writer picked up yet, oldest first
+u8  fb_queueHead;
+u8  fb_queued;			// frames in fb_queue
+u8  fb_current;			// newest frame a writer picked up
+u8  fb_newest;			// newest complete frame, incoming frames are compared against it
+u8  fb_timed[FRAME_SLOTS];	// 0: due at once, else at fb_pts
+u32 fb_pts[FRAME_SLOTS];	// presentation time, device clock
+u32 fb_seq[FRAME_SLOTS];	// frame number
+u32 fb_base[FRAME_SLOTS];	// frame number the changed prefix is counted from
+u32 fb_dirtyEnd[FRAME_SLOTS];	// end of the pixel bytes that changed since frame fb_base
+u32 fb_lastSeq;
+u32 fb_received;		// complete frames from the dataLink
+u32 fb_swaps;			// frames that became the current one
+u32 fb_superseded;		// complete frames skipped for a newer one before a writer picked them up
+u32 fb_dropped;			// complete frames thrown away because every other slot was on the wire
+u32 fb_queueMax;		// most frames ever queued
+u32 fb_late;			// frames taken more than FB_LATE_US after their time
+u32 fb_lateDropped;		// FB_LATE_DROP: late frames thrown away
+u32 fb_lateMax;			// us the latest frame was late
+u32 fb_writerLatched[FB_WRITERS];	// newest frame each writer latched
+u32 fb_latchedSeq;		// newest frame every writer latched
+fbLatchedHandler fb_onLatched;
+fbFreeHandler fb_onFree;
+#endif
+
+// wire byte color of LED led, and wire byte i of a frame - the latch zeros follow the pixels
+#if FRAME_FORMAT == FRAME_INDEXED
+u8  fb_palette[256][3];		// the wire bytes of every index
+#define FB_LED_WIRE(frame, led, color) (fb_palette[(frame)[led]][color])
+#elif FRAME_FORMAT == FRAME_RGB565
+u8  fb_wireChannel[3];		// channel of wire byte 0, 1, 2: 0 red, 1 green, 2 blue
+#define FB_LED_WIRE(frame, led, color) fb_565_wire((frame)[2 * (led)] | ((frame)[2 * (led) + 1] << 8), fb_wireChannel[color])
+#endif
+#if FRAME_FORMAT == FRAME_WIRE
+#define FB_WIRE_BYTE(frame, i) ((frame)[i])
+#else
+#define FB_WIRE_BYTE(frame, i) ((i) < LEDS * 3 ? FB_LED_WIRE(frame, (i) / 3, (i) % 3) : 0x00)
+#endif
+
+// Segments
+// The LEDs [FIRST, FIRST + LEDS) of the chain an output drives, each output
+// latches on its own. All outputs mirror the whole chain by default. To share
+// the work of a frame, e.g. rows 0-15 on the hardware SPI, 16-23 and 24-31 on
+// the soft SPIs:
+//   LW_SEG_FIRST 0                   LW_SEG_LEDS (16 * L_WIDTH)
+//   LWN34_SEG_FIRST (16 * L_WIDTH)   LWN34_SEG_LEDS (8 * L_WIDTH)
+//   LWN56_SEG_FIRST (24 * L_WIDTH)   LWN56_SEG_LEDS (8 * L_WIDTH)
+#define LW_SEG_FIRST    0
+#define LW_SEG_LEDS     LEDS
+#define LWN34_SEG_FIRST 0
+#define LWN34_SEG_LEDS  LEDS
+#define LWN56_SEG_FIRST 0
+#define LWN56_SEG_LEDS  LEDS
+#define LWP_SEG_FIRST   0
+#define LWP_SEG_LEDS    LEDS
+
+#if LW_SEG_LEDS == 0 || LW_SEG_FIRST + LW_SEG_LEDS > LEDS
+#error "hardware SPI segment is outside of LEDS"
+#endif
+#if defined SOFT_SPI && (LWN34_SEG_LEDS == 0 || LWN34_SEG_FIRST + LWN34_SEG_LEDS > LEDS || LWN56_SEG_LEDS == 0 || LWN56_SEG_FIRST + LWN56_SEG_LEDS > LEDS)
+#error "soft SPI segment is outside of LEDS"
+#endif
+#if defined PARALLEL_SPI && (LWP_SEG_LEDS == 0 || LWP_SEG_FIRST + LWP_SEG_LEDS > LEDS)
+#error "parallel SPI segment is outside of LEDS"
+#endif
+#if defined LW_STREAM && (LW_SEG_FIRST != 0 || LW_SEG_LEDS != LEDS)
+#error "LW_STREAM drives the whole chain"
+#endif
 
 // LED-Strip Writer variables
 #define LW_S_WAIT_TO_WRITE_PIXEL 1
 #define LW_S_WAIT_TO_WRITE_ZEROS  2
+#define LW_S_WAIT_FOR_FRAME       3
 
 u8  lw_state;			// This is the state of the LED_Writer State-machine
+u8  lw_slot;			// Frame slot the LED_Writer is drawing
 u8 *lw_buffer;			// Pointer to the buffer that the LED_Writer should draw
-u32 lw_pixelIndex;      // current Pixel
-u8  lw_zeroCounter;      // counter for zeros to send at the end
+u32 lw_seq;             // frame number the strip shows
+u32 lw_segStart;        // first byte of the segment on this strip
+u32 lw_segEnd;          // end of that segment
+u32 lw_pixelIndex;      // current byte in lw_buffer, zeros start at LEDS * 3
+u32 lw_spanEnd;         // end of the pixel or zero run being written
+u32 lw_framesSent;      // frames started on the wire, refreshes too, compare with fb_received
+timerContext lw_keepalive;
+
+// Output refresh
+// Comment out to loop the current frame out forever
+#define LW_REFRESH_ON_CHANGE
+#define LW_KEEPALIVE_MS 1000	// Resend an unchanged frame after this long, 0 = never
+
+// LED-Strip Writer DMA
+// Comment out to feed the SPI byte by byte from loop()
+#define LW_USE_DMA
+
+#define LW_DMA_BLOCK   256         // DCHxSSIZ is only 8 bit wide on the PIC32MX4xx
+#define LW_DMA_IRQ     38          // SPI2 TX, the module behind BUFFER/STATRX
+#define LW_DMA_CHEN    (1 << 7)    // DCHxCON: channel enable
+#define LW_DMA_CHPRI3  3           // DCHxCON: highest channel priority
+#define LW_DMA_SIRQEN  (1 << 4)    // DCHxECON: start transfer on CHSIRQ
+#define LW_DMA_CFORCE  (1 << 7)    // DCHxECON: force a single cell transfer
+#define LW_DMA_DMAON   (1 << 15)   // DMACON: module on
+#ifndef LW_KVA_TO_PA		// a host build brings its own
+#define LW_KVA_TO_PA(v) ((u32)(v) & 0x1FFFFFFF)
+#endif
+
+// LED-Strip Writer TX FIFO
+// Comment in to keep the SPI busy from its TX interrupt instead, for builds
+// without a free DMA channel. The loop only hands it the next frame.
+//#define LW_USE_FIFO
+
+#define LW_FIFO_IRQ    38          // SPI2 TX
+#define LW_FIFO_IPL    4           // above the receive timer, a refill is short
+#define LW_SPI_ON      (1 << 15)   // SPIxCON: module on
+#define LW_SPI_ENHBUF  (1 << 16)   // SPIxCON: enhanced buffer, 16 bytes deep in 8 bit mode
+#define LW_SPI_STXHALF (2 << 2)    // SPIxCON STXISEL: interrupt while the TX buffer is half empty
+#define LW_SPI_SPITBF  (1 << 1)    // SPIxSTAT: TX buffer full
+#define LW_FIFO_BIT    (1 << (LW_FIFO_IRQ - 32))
+
+#if defined LW_USE_FIFO && defined LW_USE_DMA
+#error "LW_USE_FIFO and LW_USE_DMA both feed the SPI, comment one out"
+#endif
+
+#if defined LW_USE_DMA && FRAME_FORMAT != FRAME_WIRE
+u8  lw_stage[LW_DMA_BLOCK] __attribute__((aligned(4)));	// the DMA block, expanded to wire bytes
+#endif
+
+// LED-Strip Writer cut-through
+// The dataLink queues wire bytes, the SPI takes them as soon as they are there.
+// Bytes from the host only come in while the queue has room for them and two latches.
+#define LW_STREAM_SIZE 1024	// power of two
+
+#if defined LW_STREAM && LW_STREAM_SIZE <= 2 * ZEROS_NEEDED
+#error "LW_STREAM_SIZE has to hold more than two latches"
+#endif
+
+#ifdef LW_STREAM
+u8  lws_queue[LW_STREAM_SIZE] __attribute__((aligned(4)));
+volatile u32 lws_head;		// free running byte counters, the dataLink queues at the head
+volatile u32 lws_tail;		// and the SPI takes from the tail (in its interrupt with LW_USE_FIFO)
+u32 lws_dmaLen;			// bytes of the block on its way out
+u32 lws_leds;			// LEDs of the frame queued
+u8  lws_color;			// bytes of lws_led the host sent
+u8  lws_led[3];			// wire bytes of the LED coming in
+u32 lws_framesSent;		// latches queued
+#endif
+
+// LED-Strip (no-SPI) data
+// states
+#define LWN_S_WRITE               1
+#define LWN_S_WAIT_FOR_FRAME      2
+
+// Budget of a soft SPI writer's turn in us, 0 = one byte per turn
+#define LWN_BUDGET_US 20
+
+// instance on Pin 3 (data) and Pin 4 (clock)
+lwnContext pin34Context;
+
+// instance on Pin 5 (data) and Pin 6 (clock)
+lwnContext pin56Context;
+
+u32 lwn_noPort;			// where a pin without a known port writes to
+#ifndef LWN_WRITE		// a host build brings its own, it records the edges
+#define LWN_WRITE(reg, mask) (*(reg) = (mask))
+#endif
+
+// LED-Strip (parallel soft SPI) data
+// Strip s shows LEDs [s * LWP_STRIP_LEDS, (s + 1) * LWP_STRIP_LEDS) of the
+// LWP segment. Its data line is port bit LWP_DATA_SHIFT + s, the clock line is shared.
+// More than 8 strips need a 16 bit port like PORTB.
+#define LWP_STRIPS       8
+#define LWP_DATA_LATSET  LATESET
+#define LWP_DATA_LATCLR  LATECLR
+#define LWP_DATA_TRISCLR TRISECLR
+#define LWP_DATA_SHIFT   0
+#define LWP_CLK_LATSET   LATDSET
+#define LWP_CLK_LATCLR   LATDCLR
+#define LWP_CLK_TRISCLR  TRISDCLR
+#define LWP_CLK_MASK     (1 << 4)
+
+#define LWP_STRIP_LEDS   (LWP_SEG_LEDS / LWP_STRIPS)
+#define LWP_STRIP_BYTES  (LWP_STRIP_LEDS * 3)
+#define LWP_DATA_MASK    (((1 << LWP_STRIPS) - 1) << LWP_DATA_SHIFT)
+
+#if defined PARALLEL_SPI && (LWP_STRIPS > 16 || LWP_SEG_LEDS % LWP_STRIPS != 0)
+#error "LWP_STRIPS has to be 16 or less and split LWP_SEG_LEDS evenly"
+#endif
+
+u8  lwp_state;
+u8  lwp_slot;
+u32 lwp_seq;
+u32 lwp_byteIndex;	// current byte within each strip, zeros start at LEDS * 3
+u32 lwp_spanEnd;
+u32 lwp_framesSent;
+timerContext lwp_keepalive;
 
 u8 *pixels;				// Pointer to the buffer were the dataLink will buffer incoming data
 
@@ -66,247 +517,2806 @@ u8 *pixels;				// Pointer to the buffer were the dataLink will buffer incoming d
 //#define ROTATE_CW_90
 #define ROTATE_CW_180
 
+// Comment in if the host sends frames the way they go on the wire: chain
+// order, GRB. Unframed, packets are then received straight into the back buffer.
+//#define RAW_LAYOUT
+
+// Comment out for the plain byte stream of older hosts, that one only gets
+// back in step through DATA_LINK_TIMEOUT
+#define DL_FRAMED
+// Comment in to tell the host which of its frames are latched (DL_T_LATCHED)
+//#define DL_LATCH_NOTICE
+
+#if defined DL_LATCH_NOTICE && (!defined DL_FRAMED || defined LW_STREAM)
+#error "DL_LATCH_NOTICE needs DL_FRAMED and the frame buffers"
+#endif
+
+#if defined PROFILE && !defined DL_FRAMED
+#error "PROFILE reports through DL_T_PROFILE, that needs DL_FRAMED"
+#endif
+
+#if defined RAW_LAYOUT && !defined DL_FRAMED && !defined LW_STREAM
+#define DL_DIRECT	// the interrupt receives straight into the back buffer
+#endif
+
 // Pixels on Lumi are oriented as GRB -> Pixels coming in are RGB
+// (wire byte of red, green, blue)
 u8 colorOffsetMap[3] = { 1, 0, 2 };
 
+// Geometry
+// The host's image, mirrored and turned by dl_geometry, lands on a panel of
+// width x height LEDs. The switches above set it up, the host can change it
+// with DL_T_GEOMETRY or upload a map of its own with DL_T_MAP.
+#define DL_G_MIRROR      0x01	// flip the host's image left to right first
+#define DL_G_SERPENTINE  0x02	// every other row runs back
+#define DL_G_REVERSED    0x04	// the first row runs right to left
+
+#ifndef LW_STREAM
+#if LEDS > 0xFFFF
+#error "dl_map holds 16 bit chain positions"
+#endif
+
+dlGeometry dl_geometry;
+u16 dl_map[LEDS];	// chain position of every pixel the host sends, then of the LEDs it doesn't cover
+u32 dl_pixels;		// pixels in a frame from the host
+u8  dl_identity;	// the host sends chain order and wire colors, its frames are copied as they are
+
 u8  writeColByte;
-u32 writeIndexX;
-u32 writeIndexY;
+u32 writePixel;		// pixel of the frame being received, in the host's order
+u32 writePixelPos;	// byte position of the pixel being received
+u32 writeDirtyEnd;	// end of the changed prefix of the frame being received
+u32 writeDone;		// identity map: bytes of the back buffer that are encoded and compared
+#endif
 
 #define DATA_LINK_TIMEOUT 5000
 timerContext dataLink_timer;// Timer variables for the Animator
 
+// DataLink receive ring
+// Tmr5Interrupt() moves CDC packets into the ring, dataLink_process() drains
+// it. Single producer, single consumer: only the interrupt moves dl_ringHead,
+// only the loop moves dl_ringTail, so neither needs a lock.
+#define DL_RING_SIZE 4096	// power of two
+#define DL_RX_HZ     8000	// endpoint polls per second
+#define DL_RX_BATCH  64		// most bytes one dataLink_process() step takes
+#define DL_PACKET    64		// max bytes of one CDCgets()
+#define DL_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+u8  dl_ring[DL_RING_SIZE + DL_PACKET] __attribute__((aligned(4)));	// a packet at the end spills over, then moves to the front
+volatile u32 dl_ringHead;	// free running byte counters
+volatile u32 dl_ringTail;
+volatile u32 dl_ringHighWater;	// most bytes ever waiting in the ring
+volatile u32 dl_ringOverflows;	// polls that found no room for a packet, it waits in the endpoint
+volatile u32 dl_directPos;	// DL_DIRECT: bytes of the frame in the back buffer
+volatile u32 dl_bytesIn;	// bytes the interrupt took from the endpoint
+u32 dl_bytesOut;		// bytes of the packets to the host
+u32 dl_timeouts;		// timeouts that threw a partial frame or packet away
+
+// CDC transmit ring
+// Replies and messages are copied in whole or dropped, cdc_tx_process()
+// hands them to USB a span at a time. Both ends run in the loop.
+#ifdef PROFILE
+#define CDC_TX_SIZE  2048	// power of two, holds a DL_T_PROFILE answer
+#else
+#define CDC_TX_SIZE  1024
+#endif
+#define CDC_TX_CHUNK 255	// most bytes of one putUSBUSART()
+
+#if defined PROFILE && 2 * PROF_PROBES * DL_PACKET > CDC_TX_SIZE
+#error "a DL_T_PROFILE answer doesn't fit into the transmit ring, raise CDC_TX_SIZE"
+#endif
+
+u8  cdc_txRing[CDC_TX_SIZE];
+u32 cdc_txHead;			// free running byte counters
+u32 cdc_txTail;
+u32 cdc_txBusy;			// bytes at the tail USB is sending, they stay until it is done
+u32 cdc_txHighWater;		// most bytes ever waiting in the ring
+u32 cdc_txDropped;		// replies and messages that didn't fit
+
+// RAM
+// The PIC32MX4xx has 32 KB. The frame slots (or the cut-through queue), the
+// rings and the map may take RAM_BUDGET of it, the USB stack and the other
+// variables take about 2 KB and the stack needs the rest.
+#define RAM_BUDGET (26 * 1024)
+#ifdef LW_STREAM
+#define RAM_FRAMES LW_STREAM_SIZE
+#else
+#define RAM_FRAMES (FRAME_SLOTS * FRAME_BYTES + LEDS * 2)
+#endif
+#define RAM_BUFFERS (RAM_FRAMES + DL_RING_SIZE + DL_PACKET + CDC_TX_SIZE)
+
+#if RAM_BUFFERS > RAM_BUDGET
+#error "the frame slots and rings don't fit into RAM_BUDGET, use a compact FRAME_FORMAT, fewer LEDS or writers"
+#endif
+
+// DataLink framing
+// A packet is "LUMI", type, flags, id, len, len bytes of payload and the
+// CRC-32 (IEEE 802.3, as zlib's crc32()) of type to the last payload byte.
+// id and len are 16 bit, all numbers little endian. flags is DL_F_*, 0 for none.
+// A packet stays in the ring until its CRC is checked, so after a bad one the
+// parser searches the magic again from its second byte on.
+#define DL_HEADER  10		// magic, type, flags, id, len
+#define DL_TRAILER 4		// CRC-32
+#define DL_PTS_BYTES 4		// u32 presentation time, see DL_F_PTS
+#define DL_MAX_PAYLOAD (DL_PTS_BYTES + FRAME_PIXEL_BYTES)
+
+// packet flags
+#define DL_F_PTS 0x01		// frame, RLE and delta: the payload starts with the u32 device clock time to show it at
+
+// packet types
+#define DL_T_FRAME  0x01		// one frame, LEDS pixels in the host's layout: RGB, a palette index or RGB565
+#define DL_T_CREDIT 0x02		// device: u16 id limit, host: no payload, asks for one
+#define DL_T_RLE    0x03		// run length coded frame, see dl_decode()
+#define DL_T_DELTA  0x04		// changes to the newest frame, see dl_decode()
+#define DL_T_NACK   0x05		// device: u16 id of a packet it threw away, u8 reason
+#define DL_T_PALETTE 0x06	// FRAME_INDEXED: u8 first index, then RGB of it and the following ones
+#define DL_T_GEOMETRY 0x07	// see dl_geometry_done(), no payload asks for the device's
+#define DL_T_MAP     0x08		// u16 first pixel, then the u16 chain positions of it and the following ones
+#define DL_T_CLOCK   0x09		// see dl_clock_done(), no payload asks for the device clock
+#define DL_T_LATCHED 0x0A		// device: u16 id of the newest frame packet that is latched, DL_LATCH_NOTICE
+#define DL_T_PROFILE 0x0B		// see dl_profile_done(), PROFILE
+#define DL_T_STATS   0x0C		// see dl_stats_done()
+
+#define DL_GEOMETRY_BYTES 9	// u16 width, u16 height, u8 rotation, u8 flags, u8 wire byte of R, G, B
+
+// NACK reasons
+#define DL_NACK_BASE 1		// the delta is not for the newest frame, send a whole one
+#define DL_NACK_DATA 2		// the ops don't make a frame
+
+// decoder states
+#define DL_C_BASE    1		// delta: id of the frame it changes
+#define DL_C_SKIP    2		// delta: pixels that stay
+#define DL_C_OP      3
+#define DL_C_LITERAL 4
+#define DL_C_RUN     5
+
+// Flow control
+// The host may send the packets with an id before the limit of the last
+// CREDIT. The limit is the id after the last good packet plus the frames the
+// device can take without replacing one no writer picked up yet. It only
+// grows, a lost CREDIT costs nothing. A host that lost track asks with an
+// empty CREDIT, its id restarts the count.
+#define DL_MAX_REPLY (DL_PACKET - DL_HEADER - DL_TRAILER)	// a reply goes in one CDC packet
+
+#if 2 + 4 * STATS_COUNTERS > DL_MAX_REPLY || 2 + 2 * PROF_BINS > DL_MAX_REPLY
+#error "a DL_T_STATS or DL_T_PROFILE answer doesn't fit into one packet"
+#endif
+
+// parser states
+#define DL_P_HUNT    1		// looking for the magic
+#define DL_P_HEADER  2
+#define DL_P_PAYLOAD 3
+#define DL_P_CRC     4
+
+// a packet that stops short waits this many ms for its next byte. Bytes of
+// one packet come back to back, it is well below DATA_LINK_TIMEOUT, so a bad
+// len can't hold up the link for long.
+#define DL_PACKET_TIMEOUT 100
+
+#if defined DL_FRAMED && DL_MAX_PAYLOAD > 0xFFFF
+#error "a frame doesn't fit the 16 bit len of a packet"
+#endif
+#if defined DL_FRAMED && !defined LW_STREAM && DL_HEADER + DL_MAX_PAYLOAD + DL_TRAILER > DL_RING_SIZE - DL_PACKET
+#error "the largest packet has to fit into the receive ring, raise DL_RING_SIZE"
+#endif
+
+u8  dl_magic[4] = { 'L', 'U', 'M', 'I' };
+u8  dl_state;
+u8  dl_matched;			// magic bytes found while hunting
+u8  dl_hdr[DL_HEADER - 4];	// header after the magic
+u8  dl_fieldPos;		// header or CRC bytes collected
+u8  dl_type;
+u16 dl_id;
+u16 dl_lastId;
+u32 dl_len;			// payload bytes still to come
+u32 dl_crc;			// CRC-32 of the packet so far
+u32 dl_rxCrc;			// CRC-32 the host sent
+u32 dl_parsePos;		// next ring byte to parse, free running like dl_ringTail
+u32 dl_packetStart;		// ring position of the magic of the packet being parsed
+timerContext dl_packetTimer;	// DL_PACKET_TIMEOUT since the last byte came
+u32 dl_packets;			// packets with a good CRC
+u32 dl_badHeaders;		// headers with an unknown length
+u32 dl_crcErrors;
+u32 dl_lostIds;			// packets missing between two good ones, by their id
+u16 dl_txId;			// id of the next packet to the host
+u16 dl_creditBase;		// id after the last good packet
+u16 dl_creditSent;		// limit the host got last
+u8  dl_creditNews;		// a packet or the writers made room since dl_credit_process()
+u8  dl_timed;			// the packet has DL_F_PTS
+u8  dl_ptsLeft;			// bytes of dl_pts still to come
+u32 dl_pts;
+u16 dl_newestId;		// id of the packet the newest frame came from
+u8  dl_newestValid;		// 0 until a frame came in
+u8  dl_codecState;
+u8  dl_codecBad;		// NACK reason once the packet can't make a frame
+u8  dl_runPixel[FB_LED_BYTES];
+u8  dl_fill;			// bytes of dl_runPixel or dl_word collected
+u16 dl_word;
+u32 dl_opLeft;			// bytes of a literal still to come, pixels of a run
+u32 dl_decoded;			// pixels of the frame decoded
+
+// DL_LATCH_NOTICE: fences of the frames presented and not latched yet, with their packet id
+#define DL_FENCES 8
+u32 dl_fence[DL_FENCES];
+u16 dl_fenceId[DL_FENCES];
+u8  dl_fenceHead;
+u8  dl_fences;
+u8  dl_latchNews;		// the writers latched a frame since dl_latch_process()
+
 //////////////////////////////////////////////////////////////////////////////////
 // Timer and other general functions
 //////////////////////////////////////////////////////////////////////////////////
-void reset_us_timer(timerContext *timer, u32 usDelay) {
-  timer->timer_start = GetCP0Count();
-  timer->timer_stop = timer->timer_start + usDelay * Fcp0;
+// time base, interrupt context: count the ticks up to CP0 count now. The
+// ticks go by whole tick lengths, so they never drift.
+void tb_advance(u32 now) {
+  u32 count = tb_tickCount;
+  u64 us = tb_tickUs;
+  u32 ticks = tb_ticks;
+
+  while(now - count >= tb_tickCounts) {
+    count += tb_tickCounts;
+    us += TB_TICK_US;
+    ticks++;
+  }
+  tb_tickCount = count;
+  tb_tickUs = us;
+  DL_BARRIER();		// the tick last, readers check it didn't move
+  tb_ticks = ticks;
 }
 
-void start_ms_timer(timerContext *timer, u32 msDelay) {
-  // set ms-delay to <delay>
-  timer->timer_delay = msDelay;
-  reset_us_timer(timer,1000);
+// us of the last tick and its CP0 count. Reads the tick again if the
+// interrupt moved it meanwhile.
+u64 tb_last_tick(u32 *count) {
+  u32 ticks;
+  u64 us;
+
+  do {
+    ticks = tb_ticks;
+    DL_BARRIER();
+    *count = tb_tickCount;
+    us = tb_tickUs;
+    DL_BARRIER();
+  } while(ticks != tb_ticks);
+  return us;
 }
 
-// check counter. If us-delay is up, decrement ms-delay
-// return 1, if time is up, 0, if timer still running
-u8 check_timer(timerContext *timer) {
-  if(timer->timer_start <= timer->timer_stop) {
-    // "normal" case, just wait until GetCP0Count > lb_timer_stop
-    if(GetCP0Count() > timer->timer_stop) {
-      // us timer is up, reset
-      reset_us_timer(timer,1000);
-      if( --(timer->timer_delay) == 0 )
-        return 1;
-    }
-  } else {
-    // "overflow" case, wait until count is smaller then start 
-    // (=> count did the overflow, too) and then until count > stop		
-    if( GetCP0Count() < timer->timer_start && GetCP0Count() > timer->timer_stop ) {
-      // us timer is up, reset
-      reset_us_timer(timer,1000);
-      if( --(timer->timer_delay) == 0 )
-        return 1;
+// us since setup at CP0 count now, from the last tick. A count from before
+// that tick, the interrupt came after it was read, counts as the tick: now -
+// count would wrap to 107 s on.
+u64 tb_us_at(u32 now) {
+  u32 count;
+  u64 us = tb_last_tick(&count);
+
+  if((s32)(now - count) < 0)
+    return us;
+  return us + (now - count) / Fcp0;
+}
+
+// us since setup
+u64 time_us() {
+  return tb_us_at(GetCP0Count());
+}
+
+void tb_setup() {
+  tb_tickCounts = TB_TICK_US * Fcp0;
+  tb_tickCount = GetCP0Count();
+  tb_tickUs = 0;
+  tb_ticks = 0;
+  clk_offset = 0;
+
+  // timer 4 makes sure Tmr4Interrupt() comes by once a tick
+  IntConfigureSystem(INT_SYSTEM_CONFIG_MULT_VECTOR);
+  T4CON = 0;
+  TMR4 = 0;
+  PR4 = GetPeripheralClock() / 8 / (1000000 / TB_TICK_US) - 1;
+  IntSetVectorPriority(INT_TIMER4_VECTOR, TB_IPL, 0);
+  IntClearFlag(INT_TIMER4);
+  IntEnable(INT_TIMER4);
+  T4CON = 0x8030;	// on, 1:8 prescaler
+}
+
+void Tmr4Interrupt(void) {
+  if(IntGetFlag(INT_TIMER4)) {
+    tb_advance(GetCP0Count());
+    IntClearFlag(INT_TIMER4);
+  }
+}
+
+// hang the timer into the slot of its due tick
+void tw_link(timerContext *timer) {
+  timerContext **head = &tw_slot[timer->timer_due & (TW_SLOTS - 1)];
+
+  timer->timer_next = *head;
+  if(*head)
+    (*head)->timer_link = &timer->timer_next;
+  timer->timer_link = head;
+  *head = timer;
+  timer->timer_state = TW_ARMED;
+}
+
+void tw_unlink(timerContext *timer) {
+  *timer->timer_link = timer->timer_next;
+  if(timer->timer_next)
+    timer->timer_next->timer_link = timer->timer_link;
+}
+
+// (re)arm the timer to run out at tick due. The wheel is behind the time
+// base at most, so a tick after tb_ticks always comes by its slot.
+void tw_start(timerContext *timer, u32 due) {
+  if(timer->timer_state == TW_ARMED)
+    tw_unlink(timer);
+  timer->timer_due = due;
+  tw_link(timer);
+}
+
+// the wheel comes by tick: the timers due run out, the others wait a round
+void tw_expire(u32 tick) {
+  timerContext *timer = tw_slot[tick & (TW_SLOTS - 1)];
+  timerContext *next;
+
+  for(; timer != 0; timer = next) {
+    next = timer->timer_next;
+    if(timer->timer_due == tick) {
+      tw_unlink(timer);
+      timer->timer_state = TW_FIRED;
     }
   }
+}
+
+// catch the wheel up with the time base
+u8 tw_process() {
+  u32 now = tb_ticks;
+
+  while(tw_tick != now)
+    tw_expire(++tw_tick);
   return 0;
 }
 
-void switch_buffers() {
-  if(lw_buffer == pixel_buff_one) {
-    lw_buffer = pixel_buff_two;
-    pixels = pixel_buff_one;
-  } else {
-    lw_buffer = pixel_buff_one;
-    pixels = pixel_buff_two;
-  }
+void start_ms_timer(timerContext *timer, u32 msDelay) {
+  tw_start(timer, tb_ticks + msDelay * 1000 / TB_TICK_US);
+}
+
+// periodic: due msDelay after it was due last, not after the loop noticed.
+// A loop that fell behind a whole period or more skips the periods missed.
+void repeat_ms_timer(timerContext *timer, u32 msDelay) {
+  u32 due = timer->timer_due + msDelay * 1000 / TB_TICK_US;
+
+  if((s32)(due - tb_ticks) <= 0)
+    due = tb_ticks + 1;
+  tw_start(timer, due);
+}
+
+void stop_timer(timerContext *timer) {
+  if(timer->timer_state == TW_ARMED)
+    tw_unlink(timer);
+  timer->timer_state = TW_IDLE;
+}
+
+// return 1 once, when the timer ran out, 0 while it is still running
+u8 check_timer(timerContext *timer) {
+  if(timer->timer_state != TW_FIRED)
+    return 0;
+  timer->timer_state = TW_IDLE;
+  return 1;
+}
+
+// device clock in us, wraps after 71 minutes
+u32 clock_us() {
+  return (u32)time_us() + clk_offset;
+}
+
+void clock_set(u32 us) {
+  clk_offset = us - (u32)time_us();
 }
 
 //////////////////////////////////////////////////////////////////////////////////
-// LED-Strip Writer
+// Profiler
 //////////////////////////////////////////////////////////////////////////////////
-void lw_setup() {
-  // start by writing zeros to wake-up latch(s)
-  lw_state = LW_S_WAIT_TO_WRITE_ZEROS;
-  lw_pixelIndex = 0;
-  lw_zeroCounter = ZEROS_NEEDED;
+#ifdef PROFILE
+void prof_clear() {
+  profProbe *probe;
+  u8 k;
 
-  SPI_init();
-  /* 10mhz - faster is not working */
-  SPI_clock(GetSystemClock() / SPI_PBCLOCK_DIV16);
-  SPI_mode(SPI_MASTER);
-  BUFFER = 0x00; // Trigger STATRX
+  for(probe = prof; probe < prof + PROF_PROBES; probe++) {
+    probe->calls = 0;
+    probe->min = 0xFFFFFFFF;
+    probe->max = 0;
+    probe->sum = 0;
+    for(k = 0; k < PROF_BINS; k++)
+      probe->bins[k] = 0;
+  }
+  prof_roundStart = GetCP0Count();
 }
 
-void lw_process() {
-  if(lw_state == LW_S_WAIT_TO_WRITE_PIXEL && (STATRX)) {
-    // ready to write a pixel
-    BUFFER = (0x80 | lw_buffer[lw_pixelIndex++]);
-    if(lw_pixelIndex >= (LEDS * 3)) {
-      // sent'em all
-      lw_state = LW_S_WAIT_TO_WRITE_ZEROS;
-      lw_zeroCounter = ZEROS_NEEDED;
-    }
+// one call of the probe took counts CP0 counts
+void prof_add(profProbe *probe, u32 counts) {
+  u8 bin = 31 - __builtin_clz(counts | 1);	// clz is one instruction on the M4K
+
+  probe->calls++;
+  probe->sum += counts;
+  if(counts < probe->min)
+    probe->min = counts;
+  if(counts > probe->max)
+    probe->max = counts;
+  probe->bins[bin < PROF_BINS ? bin : PROF_BINS - 1]++;
+}
+
+// 0 for the task probes nobody registered
+const char *prof_name(u8 probe) {
+  if(probe == PROF_LOOP)
+    return "loop";
+  if(probe == PROF_RX)
+    return "rx";
+  if(probe - PROF_TASK < sched_tasks)
+    return sched_task[probe - PROF_TASK].name;
+  return 0;
+}
+#endif
+
+#ifndef LW_STREAM
+// blank frame: all pixels off, in wire format latch zeros at the end
+void frame_clear(u8 *frame) {
+  u32 i;
+#if FRAME_FORMAT == FRAME_WIRE
+  u32 *words = (u32 *)frame;
+
+  for(i = 0; i < (LEDS * 3) / 4; i++)
+    words[i] = 0x80808080;
+  for(i = (LEDS * 3) & ~3; i < LEDS * 3; i++)
+    frame[i] = 0x80;
+  for(i = LEDS * 3; i < FRAME_BYTES; i++)
+    frame[i] = 0x00;
+#else
+  // index 0, black until the host sends a palette
+  for(i = 0; i < FRAME_BYTES; i++)
+    frame[i] = 0x00;
+#endif
+}
+
+#if FRAME_FORMAT == FRAME_RGB565
+// wire byte of one channel of an RGB565 color: its top bits repeat in the low
+// bits, so full scale stays full scale
+u8 fb_565_wire(u32 color, u8 channel) {
+  switch(channel) {
+  case 0:
+    color = (color >> 11) & 0x1F;
+    return 0x80 | (color << 2) | (color >> 3);
+  case 1:
+    color = (color >> 5) & 0x3F;
+    return 0x80 | (color << 1) | (color >> 5);
+  default:
+    color &= 0x1F;
+    return 0x80 | (color << 2) | (color >> 3);
   }
-  if(lw_state == LW_S_WAIT_TO_WRITE_ZEROS && (STATRX)) {
-    // ready to write a zero
-    BUFFER = 0x00;
-    if(--lw_zeroCounter == 0) {
-      // done with zeros, write pixels
-      lw_state = LW_S_WAIT_TO_WRITE_PIXEL;
-      lw_pixelIndex = 0;
+}
+#endif
+
+#if FRAME_FORMAT != FRAME_WIRE
+// wire bytes [index, index + n) of frame
+void fb_wire_bytes(const u8 *frame, u32 index, u8 *out, u32 n) {
+  u32 led = index / 3;
+  u8 color = index % 3;
+
+  for(; n > 0 && index < LEDS * 3; n--, index++) {
+    *out++ = FB_LED_WIRE(frame, led, color);
+    if(++color == 3) {
+      color = 0;
+      led++;
     }
   }
+  // latch zeros
+  for(; n > 0; n--)
+    *out++ = 0x00;
 }
+#endif
+#endif
 
 //////////////////////////////////////////////////////////////////////////////////
-// DataLink
+// Frame buffers
 //////////////////////////////////////////////////////////////////////////////////
-void dataLink_setup() {
-  writeColByte = 0;
-  writeIndexX = 0;
-  writeIndexY = 0;
+#ifndef LW_STREAM
+void fb_setup() {
+  u32 i;
 
-  CDCprintf("READY!\n");
+#if FRAME_FORMAT == FRAME_INDEXED
+  for(i = 0; i < 256; i++) {
+    fb_palette[i][0] = 0x80;
+    fb_palette[i][1] = 0x80;
+    fb_palette[i][2] = 0x80;
+  }
+#endif
+#if FRAME_FORMAT == FRAME_RGB565
+  for(i = 0; i < 3; i++)
+    fb_wireChannel[colorOffsetMap[i]] = i;
+#endif
+  for(i = 0; i < FRAME_SLOTS; i++) {
+    frame_clear(frame_buff[i]);
+    fb_users[i] = 0;
+    fb_timed[i] = 0;
+    fb_seq[i] = 0;
+    fb_base[i] = FB_SEQ_NONE;
+    fb_dirtyEnd[i] = LEDS * 3;
+  }
+  fb_lastSeq = 0;
+  fb_current = 0;
+  fb_newest = 0;
+  fb_back = 1;
+  fb_queueHead = 0;
+  fb_queued = 0;
+  fb_received = 0;
+  fb_swaps = 0;
+  fb_superseded = 0;
+  fb_dropped = 0;
+  fb_queueMax = 0;
+  fb_late = 0;
+  fb_lateDropped = 0;
+  fb_lateMax = 0;
+  for(i = 0; i < FB_WRITERS; i++)
+    fb_writerLatched[i] = 0;
+  fb_latchedSeq = 0;
+  fb_onLatched = 0;
+  fb_onFree = 0;
+}
 
-  start_ms_timer(&dataLink_timer, DATA_LINK_TIMEOUT);
-  // Nothing more to do here, CDC is initialised in main32.c
+// a slot nobody draws, fills or waits for. The newest frame stays, it is what
+// the next one is compared against.
+u8 fb_free_slot() {
+  u8 i, q;
+
+  for(i = 0; i < FRAME_SLOTS; i++) {
+    if(i == fb_back || i == fb_newest || fb_users[i] != 0)
+      continue;
+    for(q = 0; q < fb_queued && fb_queue[(fb_queueHead + q) % FB_QUEUE] != i; q++)
+      ;
+    if(q == fb_queued)
+      return i;
+  }
+  return FB_NONE;
 }
 
-void dataLink_process() {
-  char buffer[64];
-  u8 bytesRead; // Will be max 64
-  u8 i = 0;
-  u32 insertPos = 0;
+// Output API
+// A producer fills the buffer fb_acquire() returns and hands it over with
+// fb_present(), then fills the next one fb_acquire() returns. There is one
+// back buffer, so one producer at a time. fb_present() returns a fence that
+// fb_latched() checks, or the producer registers handlers with fb_notify().
+// They run in the writers' part of loop(), keep them short.
 
-  if(check_timer(&dataLink_timer)) {
-    CDCprintf("Timeout, init index - READY!\n");
+// producer: the buffer to fill, in the frame format
+u8 *fb_acquire() {
+  return frame_buff[fb_back];
+}
 
-    writeColByte = 0;
-    writeIndexX = 0;
-    writeIndexY = 0;
+// producer: the buffer from fb_acquire() holds a complete frame that differs
+// from the newest one in the bytes before dirtyEnd. Queue it for the writers,
+// due at once or, if timed, at device clock pts, and continue on another slot.
+// Never waits for the writers.
+// Returns the fence of the frame, 0 if it had to be dropped.
+u32 fb_present(u32 dirtyEnd, u8 timed, u32 pts) {
+  u8 next = FB_NONE;
+  u32 base = fb_seq[fb_newest];
 
-    start_ms_timer(&dataLink_timer, DATA_LINK_TIMEOUT);
+  fb_received++;
+  dirtyEnd = ((dirtyEnd + FB_LED_BYTES - 1) / FB_LED_BYTES) * 3;	// whole LEDs, in wire bytes
+  if(fb_queued < FB_QUEUE)
+    next = fb_free_slot();
+  if(next == FB_NONE) {
+    if(fb_queued == 0) {
+      // all other slots are on the wire, the back buffer gets overwritten
+      fb_dropped++;
+      return 0;
+    }
+    // no room - the newer frame wins, reuse the slot of the last one queued.
+    // It takes the old one's place, so its prefix has to cover both changes.
+    fb_superseded++;
+    next = fb_queue[(fb_queueHead + --fb_queued) % FB_QUEUE];
+    base = fb_base[next];
+    if(fb_dirtyEnd[next] > dirtyEnd)
+      dirtyEnd = fb_dirtyEnd[next];
   }
+  fb_seq[fb_back] = ++fb_lastSeq;
+  fb_base[fb_back] = base;
+  fb_dirtyEnd[fb_back] = dirtyEnd;
+  fb_timed[fb_back] = timed;
+  fb_pts[fb_back] = pts;
+  fb_queue[(fb_queueHead + fb_queued++) % FB_QUEUE] = fb_back;
+  if(fb_queued > fb_queueMax)
+    fb_queueMax = fb_queued;
+  fb_newest = fb_back;
+  fb_back = next;
+  return fb_lastSeq;
+}
 
-  bytesRead = CDCgets(buffer);
-
-  if(bytesRead > 0) {
-    // Reset Timer
-    start_ms_timer(&dataLink_timer, DATA_LINK_TIMEOUT);
+// 1 once the frame of fence, or a newer one, is latched by every writer.
+// Frames that were skipped or dropped late count as latched with the next one.
+u8 fb_latched(u32 fence) {
+  return (s32)(fb_latchedSeq - fence) >= 0;
+}
 
-    // write bytes to buffer
-    for(i = 0; i < bytesRead; i++) {
+// frames a producer can present before a newer one takes the place of the last queued
+u8 fb_room() {
+  return FB_QUEUE - fb_queued;
+}
 
-#if defined ROTATE_CW_90
+// handlers for latched frames and room in the queue, 0 for none
+void fb_notify(fbLatchedHandler latched, fbFreeHandler free) {
+  fb_onLatched = latched;
+  fb_onFree = free;
+}
 
-      // rotation cw 90
-      // width => height, height => width
-      if( writeIndexX % 2 == 0 ) {
-        // even column
-        insertPos = ( (L_WIDTH - 1 - writeIndexY) + writeIndexX * L_HEIGHT );        
-      } else {
-        // odd column
-        insertPos = ( writeIndexY + writeIndexX * L_HEIGHT );
-      }
+// writer at its latch boundary: its LEDs show frame seq
+void fb_latch(u8 writer, u32 seq) {
+  u32 oldest = seq;
+  u8 i;
 
-#elif defined ROTATE_CW_180
+  if(seq == FB_SEQ_NONE || seq == fb_writerLatched[writer])
+    return;
+  fb_writerLatched[writer] = seq;
+  for(i = 0; i < FB_WRITERS; i++) {
+    if((s32)(fb_writerLatched[i] - oldest) < 0)
+      oldest = fb_writerLatched[i];
+  }
+  if(oldest != fb_latchedSeq) {
+    fb_latchedSeq = oldest;
+    if(fb_onLatched)
+      fb_onLatched(oldest);
+  }
+}
 
-      // rotation cw 180
-      // start from the bottom (x = WIDTH - 1 - x, y= HEIGHT - 1 - y)
-      if( (L_HEIGHT - 1 - writeIndexY) % 2 == 0 ) {
-        // even line
-        insertPos = ( (L_HEIGHT - 1 - writeIndexY) * L_WIDTH ) + ( L_WIDTH - 1 - writeIndexX);
-      } else {
-        // odd line
-        insertPos = ( (L_HEIGHT - 1 - writeIndexY) * L_WIDTH ) +  writeIndexX;
-      }
+u8 fb_due(u8 slot, u32 now) {
+  return !fb_timed[slot] || (s32)(now - fb_pts[slot]) >= 0;
+}
 
-#else
-      // no rotation
-      if( writeIndexY % 2 == 0 ) {
-        // even line
-        insertPos = ( writeIndexY * L_WIDTH ) + writeIndexX;
-      } else {
-        // odd line
-        insertPos = ( writeIndexY * L_WIDTH ) + (L_WIDTH - 1 - writeIndexX);
-      }
+// the queued frame slot is not shown: the next one's prefix has to cover its changes, too
+void fb_skip(u8 slot) {
+  u8 next;
 
-#endif
+  if(fb_queued == 0)
+    return;
+  next = fb_queue[fb_queueHead];
+  fb_base[next] = fb_base[slot];
+  if(fb_dirtyEnd[slot] > fb_dirtyEnd[next])
+    fb_dirtyEnd[next] = fb_dirtyEnd[slot];
+}
 
-      insertPos *= 3;
-      insertPos += colorOffsetMap[writeColByte];  
+// the newest queued frame that is due becomes the current one. A frame is
+// never shown before the ones queued ahead of it.
+void fb_advance() {
+  u32 now = clock_us();
+  u32 late;
+  u8 slot;
 
-      /*DEBUG*///CDCprintf("x: %d, y: %d, byte: %d = %d\n", writeIndexX, writeIndexY, writeColByte, insertPos);
+  if(fb_queued == 0 || !fb_due(fb_queue[fb_queueHead], now))
+    return;
+  do {
+    slot = fb_queue[fb_queueHead];
+    fb_queueHead = (fb_queueHead + 1) % FB_QUEUE;
+    fb_queued--;
 
-      pixels[insertPos] = buffer[i];
+    if(fb_queued > 0 && fb_due(fb_queue[fb_queueHead], now)) {
+      // a newer one is due, too
+      fb_superseded++;
+      fb_skip(slot);
+      continue;
+    }
+    late = fb_timed[slot] ? now - fb_pts[slot] : 0;
+    if(late > FB_LATE_US) {
+      fb_late++;
+      if(late > fb_lateMax)
+        fb_lateMax = late;
+#ifdef FB_LATE_DROP
+      fb_lateDropped++;
+      fb_skip(slot);
+      continue;
+#endif
+    }
+    fb_current = slot;
+    fb_swaps++;
+  } while(fb_queued > 0 && fb_due(fb_queue[fb_queueHead], now));
+  if(fb_onFree)
+    fb_onFree();
+}
 
-      // incerement counters
-      writeColByte += 1;
-      if(writeColByte == 3) {  
-        // reset color-byte-counter
-        writeColByte = 0;
+// writer: start drawing the current frame
+u8 fb_attach() {
+  fb_users[fb_current]++;
+  return fb_current;
+}
 
-        // got to next column
-        writeIndexX += 1;
-#ifdef ROTATE_CW_90
-        if(writeIndexX == L_HEIGHT) {
-#else
-        if(writeIndexX == L_WIDTH) {
+// writer at its latch boundary: drop slot, return the slot with the newest frame that is due
+u8 fb_take(u8 slot) {
+  fb_advance();
+  if(slot != fb_current) {
+    fb_users[slot]--;
+    fb_users[fb_current]++;
+  }
+  return fb_current;
+}
 #endif
-          // reset column
-          writeIndexX = 0;
-          // go to next row
-          writeIndexY += 1;
-        }
-      }
 
-#ifdef ROTATE_CW_90
-      if(writeIndexY == L_WIDTH) {
+//////////////////////////////////////////////////////////////////////////////////
+// LED-Strip Writer
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef LW_STREAM
+// latch is out: pick up the newest frame in slot and set end to the end of
+// the bytes of the segment [segStart, segEnd) that have to go out.
+// Returns 0 if the strip already shows the frame.
+u8 lw_frame_due(u8 writer, u8 *slot, u32 *seq, timerContext *keepalive, u32 segStart, u32 segEnd, u32 *end) {
+  fb_latch(writer, *seq);
+  *slot = fb_take(*slot);
+
+  if(fb_seq[*slot] != *seq) {
+    // new frame: if it follows the one on the strip only its changed prefix has to go out
+    *end = segEnd;
+    if(fb_base[*slot] == *seq && fb_dirtyEnd[*slot] < segEnd)
+      *end = fb_dirtyEnd[*slot];
+    *seq = fb_seq[*slot];
+#if defined LW_REFRESH_ON_CHANGE && LW_KEEPALIVE_MS > 0
+    start_ms_timer(keepalive, LW_KEEPALIVE_MS);
+#endif
+    return *end > segStart;
+  }
+  *end = segEnd;
+#ifdef LW_REFRESH_ON_CHANGE
+#if LW_KEEPALIVE_MS > 0
+  if(check_timer(keepalive)) {
+    repeat_ms_timer(keepalive, LW_KEEPALIVE_MS);
+    return 1;
+  }
+#endif
+  return 0;
 #else
-      if(writeIndexY == L_HEIGHT) { 
+  return 1;
 #endif
-          // We're at the end of the buffer
-          /*DEBUG*///CDCprintf("Received an image, switching buffers - READY!\n");
-          switch_buffers();
+}
 
-          writeColByte = 0;
-          writeIndexX = 0;
-          writeIndexY = 0;
-        }
-      }
+// the pixels [segStart, spanEnd) are out: continue with the latch zeros for
+// them, taken from the zero tail of the frame. Returns 0 once the zeros are out, too.
+u8 lw_next_span(u32 *index, u32 *spanEnd, u32 segStart) {
+  if(*spanEnd > LEDS * 3)
+    return 0;
+  *index = LEDS * 3;
+  *spanEnd = LEDS * 3 + ZEROS_FOR((*spanEnd - segStart) / 3);
+  return 1;
+}
+
+// advance the writer by n bytes: pixels, then the latch zeros
+void lw_advance(u32 n) {
+  lw_pixelIndex += n;
+  if(lw_pixelIndex == lw_spanEnd) {
+    if(lw_next_span(&lw_pixelIndex, &lw_spanEnd, lw_segStart)) {
+      // sent'em all
+      lw_state = LW_S_WAIT_TO_WRITE_ZEROS;
+    } else {
+      lw_state = LW_S_WAIT_FOR_FRAME;
     }
   }
+}
 
-  //////////////////////////////////////////////////////////////////////////////////
-  // MAIN Setup & process
-  //////////////////////////////////////////////////////////////////////////////////
-  void setup() {
-    u32 i;
-
-    CDCprintf("Setup..\n");
-
-    // for delays - CP0Count counts at half the CPU rate
-    Fcp0 = GetSystemClock() / 1000000 / 2;   // max = 40 for 80MHz
+// latch is out: continue with the newest complete frame, or wait for one
+u8 lw_next_frame() {
+  if(!lw_frame_due(FB_W_SPI, &lw_slot, &lw_seq, &lw_keepalive, lw_segStart, lw_segEnd, &lw_spanEnd))
+    return 0;
+  lw_buffer = frame_buff[lw_slot];
+  lw_pixelIndex = lw_segStart;
+  lw_state = LW_S_WAIT_TO_WRITE_PIXEL;
+  lw_framesSent++;
+  return 1;
+}
 
-    // Reset pixels
-    for(i = 0; i< LEDS*3; i++) {
-      pixel_buff_one[i] = 0x00;
-      pixel_buff_two[i] = 0x00;
+#ifdef LW_USE_FIFO
+// top the TX FIFO up with the frame, pixels then latch zeros. Runs in the SPI
+// interrupt, which turns itself off once the latch is out.
+void lw_fifo_fill() {
+  while(!(SPI2STAT & LW_SPI_SPITBF)) {
+    BUFFER = FB_WIRE_BYTE(lw_buffer, lw_pixelIndex);
+    lw_advance(1);
+    if(lw_state == LW_S_WAIT_FOR_FRAME) {
+      // lw_process() picks the next frame
+      IEC1CLR = LW_FIFO_BIT;
+      return;
     }
+  }
+}
+#endif
+#endif
+
+#ifdef LW_USE_DMA
+// hand len bytes to DMA channel 0, the SPI TX interrupt flag paces them
+void lw_dma_start(u8 *src, u32 len) {
+  DCH0SSA = LW_KVA_TO_PA(src);
+  DCH0SSIZ = len & 0xFF;            // 0 means 256
+  DCH0INTCLR = 0xFF;
+  IFS1CLR = 1 << (LW_DMA_IRQ - 32);
+  DCH0CONSET = LW_DMA_CHEN;
+  DCH0ECONSET = LW_DMA_CFORCE;      // TX buffer is already empty, kick the first byte
+}
+#endif
+
+// the SPI, and its DMA channel with LW_USE_DMA or its TX interrupt with LW_USE_FIFO
+void lw_spi_setup() {
+  SPI_init();
+  /* 10mhz - faster is not working */
+  SPI_clock(GetSystemClock() / SPI_PBCLOCK_DIV16);
+  SPI_mode(SPI_MASTER);
+
+#ifdef LW_USE_DMA
+  // channel 0: one byte per SPI TX event from lw_buffer into BUFFER
+  DMACONSET = LW_DMA_DMAON;
+  DCH0CON = LW_DMA_CHPRI3;
+  DCH0ECON = (LW_DMA_IRQ << 8) | LW_DMA_SIRQEN;
+  DCH0DSA = LW_KVA_TO_PA(&BUFFER);
+  DCH0DSIZ = 1;
+  DCH0CSIZ = 1;
+#elif defined LW_USE_FIFO
+  // enhanced buffer, takes effect with the module off
+  SPI2CONCLR = LW_SPI_ON;
+  SPI2CONSET = LW_SPI_ENHBUF | LW_SPI_STXHALF;
+  SPI2CONSET = LW_SPI_ON;
+  IEC1CLR = LW_FIFO_BIT;
+  IFS1CLR = LW_FIFO_BIT;
+  IntSetVectorPriority(INT_SPI2_VECTOR, LW_FIFO_IPL, 0);
+#else
+  BUFFER = 0x00; // Trigger STATRX
+#endif
+}
+
+#ifndef LW_STREAM
+void lw_setup() {
+  // start by writing zeros to wake-up latch(s)
+  lw_state = LW_S_WAIT_TO_WRITE_ZEROS;
+  lw_segStart = LW_SEG_FIRST * 3;
+  lw_segEnd = (LW_SEG_FIRST + LW_SEG_LEDS) * 3;
+  lw_pixelIndex = LEDS * 3;
+  lw_spanEnd = LEDS * 3 + ZEROS_FOR(LW_SEG_LEDS);
+  lw_seq = FB_SEQ_NONE;
+  lw_slot = fb_attach();
+  lw_buffer = frame_buff[lw_slot];
+  lw_framesSent = 0;
+  start_ms_timer(&lw_keepalive, LW_KEEPALIVE_MS);
+
+  lw_spi_setup();
+}
+
+// one DMA block, one FIFO handover or one byte. Returns 1 if another call
+// may get more out right away.
+u8 lw_process() {
+#ifdef LW_USE_DMA
+  u32 len;
+
+  if(DCH0CON & LW_DMA_CHEN) {
+    // block still on its way out
+    return 0;
+  }
+  if(lw_state == LW_S_WAIT_FOR_FRAME && !lw_next_frame()) {
+    // strip is up to date
+    return 0;
+  }
+  len = lw_spanEnd - lw_pixelIndex;
+  if(len > LW_DMA_BLOCK)
+    len = LW_DMA_BLOCK;
+#if FRAME_FORMAT == FRAME_WIRE
+  // block done: the frame is already wire format, DMA straight from it
+  lw_dma_start(lw_buffer + lw_pixelIndex, len);
+#else
+  // block done: the stage is free again, expand the next block into it
+  fb_wire_bytes(lw_buffer, lw_pixelIndex, lw_stage, len);
+  lw_dma_start(lw_stage, len);
+#endif
+  lw_advance(len);
+  return 0;
+#elif defined LW_USE_FIFO
+  if(IEC1 & LW_FIFO_BIT) {
+    // the interrupt is still on the frame
+    return 0;
+  }
+  if(lw_state == LW_S_WAIT_FOR_FRAME && !lw_next_frame()) {
+    // strip is up to date
+    return 0;
+  }
+  // hand the frame to the interrupt, raising its flag kicks the first fill
+  IEC1SET = LW_FIFO_BIT;
+  IFS1SET = LW_FIFO_BIT;
+  return 0;
+#else
+  if(!STATRX) {
+    // the last byte is still going out, worth waiting for
+    return lw_state != LW_S_WAIT_FOR_FRAME;
+  }
+  if(lw_state == LW_S_WAIT_FOR_FRAME && !lw_next_frame()) {
+    // strip is up to date
+    return 0;
+  }
+  BUFFER = FB_WIRE_BYTE(lw_buffer, lw_pixelIndex);
+  lw_advance(1);
+  return 1;
+#endif
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////
+// LED-Strip Writer (cut-through)
+//////////////////////////////////////////////////////////////////////////////////
+#ifdef LW_STREAM
+// the LEDs queued so far get their latch, the next byte is for the first LED again
+void lws_latch() {
+  u32 n = ZEROS_FOR(lws_leds);
+  u32 i;
+
+  for(i = 0; i < n; i++)
+    lws_queue[(lws_head + i) & (LW_STREAM_SIZE - 1)] = 0x00;
+  DL_BARRIER();		// bytes first, then the head that publishes them
+  lws_head += n;
+  lws_leds = 0;
+  lws_framesSent++;
+}
+
+// a frame starts: latch one that broke off, drop the bytes of a half LED
+void lws_restart() {
+  lws_color = 0;
+  if(lws_leds > 0)
+    lws_latch();
+}
+
+// bytes from the host the queue takes now: each makes at most one wire byte,
+// a frame that ends and one that breaks off add their latch
+u32 lws_room() {
+  u32 room = LW_STREAM_SIZE - (lws_head - lws_tail);
+
+  return (room > 2 * ZEROS_NEEDED) ? room - 2 * ZEROS_NEEDED : 0;
+}
+
+// the next n bytes of the frame, RGB of the LEDs in chain order (wire order
+// with RAW_LAYOUT): queue them as wire bytes, the latch after the last LED
+void lws_put(const u8 *data, u32 n) {
+  u32 i;
+  u8 c;
+
+  for(i = 0; i < n; i++) {
+#ifdef RAW_LAYOUT
+    lws_led[lws_color] = data[i] | 0x80;
+#else
+    lws_led[colorOffsetMap[lws_color]] = data[i] | 0x80;
+#endif
+    if(++lws_color < 3)
+      continue;
+    lws_color = 0;
+    for(c = 0; c < 3; c++)
+      lws_queue[(lws_head + c) & (LW_STREAM_SIZE - 1)] = lws_led[c];
+    DL_BARRIER();
+    lws_head += 3;
+    if(++lws_leds == LEDS)
+      lws_latch();
+  }
+}
+
+void lws_setup() {
+  u32 i;
+
+  lws_head = 0;
+  lws_tail = 0;
+  lws_dmaLen = 0;
+  lws_leds = 0;
+  lws_color = 0;
+  lws_framesSent = 0;
+  // start by writing zeros to wake-up latch(s)
+  for(i = 0; i < ZEROS_NEEDED; i++)
+    lws_queue[lws_head++] = 0x00;
+
+  lw_spi_setup();
+}
+
+#ifdef LW_USE_FIFO
+// top the TX FIFO up from the queue. Runs in the SPI interrupt, which turns
+// itself off when the queue is empty.
+void lws_fifo_fill() {
+  u32 tail = lws_tail;
+
+  while(tail != lws_head && !(SPI2STAT & LW_SPI_SPITBF))
+    BUFFER = lws_queue[tail++ & (LW_STREAM_SIZE - 1)];
+  DL_BARRIER();		// done with the bytes before handing them back
+  lws_tail = tail;
+  if(tail == lws_head)
+    IEC1CLR = LW_FIFO_BIT;
+}
+#endif
+
+// hand the SPI what is queued. Returns 1 if another call may get more out right away.
+u8 lws_process() {
+#ifdef LW_USE_DMA
+  u32 pos, len;
+
+  if(DCH0CON & LW_DMA_CHEN) {
+    // block still on its way out
+    return 0;
+  }
+  lws_tail += lws_dmaLen;
+  pos = lws_tail & (LW_STREAM_SIZE - 1);
+  len = lws_head - lws_tail;
+  // up to the end of the queue, the rest goes with the next block
+  if(len > LW_STREAM_SIZE - pos)
+    len = LW_STREAM_SIZE - pos;
+  if(len > LW_DMA_BLOCK)
+    len = LW_DMA_BLOCK;
+  lws_dmaLen = len;
+  if(len > 0)
+    lw_dma_start(lws_queue + pos, len);
+  return 0;
+#elif defined LW_USE_FIFO
+  // the interrupt went idle on an empty queue: wake it up
+  if(!(IEC1 & LW_FIFO_BIT) && lws_head != lws_tail) {
+    IEC1SET = LW_FIFO_BIT;
+    IFS1SET = LW_FIFO_BIT;
+  }
+  return 0;
+#else
+  if(lws_head == lws_tail)
+    return 0;
+  if(STATRX)
+    BUFFER = lws_queue[lws_tail++ & (LW_STREAM_SIZE - 1)];
+  return 1;
+#endif
+}
+#endif
+
+// SPI TX interrupt: with LW_USE_FIFO the FIFO is half empty, keep it going
+void SPI2Interrupt(void) {
+#ifdef LW_USE_FIFO
+#ifdef LW_STREAM
+  lws_fifo_fill();
+#else
+  lw_fifo_fill();
+#endif
+#endif
+  IFS1CLR = LW_FIFO_BIT;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// LED-Strip Writer (no-SPI)
+//////////////////////////////////////////////////////////////////////////////////
+#ifdef SOFT_SPI
+// the LAT SET and CLR registers and the bit of a pin, as digitalwrite() finds
+// them. 0 for a pin on a port this chip doesn't have: it writes nowhere.
+u8 lwn_port(u8 pin, volatile u32 **set, volatile u32 **clr, u32 *mask) {
+  *mask = pinmask[pin];
+  switch(portmask[pin]) {
+#ifdef _PORTA_RA0_MASK		// not on the 64 pin chips
+    case pA: *set = &LATASET; *clr = &LATACLR; return 1;
+#endif
+    case pB: *set = &LATBSET; *clr = &LATBCLR; return 1;
+    case pC: *set = &LATCSET; *clr = &LATCCLR; return 1;
+    case pD: *set = &LATDSET; *clr = &LATDCLR; return 1;
+    case pE: *set = &LATESET; *clr = &LATECLR; return 1;
+    case pF: *set = &LATFSET; *clr = &LATFCLR; return 1;
+    case pG: *set = &LATGSET; *clr = &LATGCLR; return 1;
+  }
+  *set = *clr = &lwn_noPort;
+  *mask = 0;
+  return 0;
+}
+
+// clock one byte out, MSB first
+void lwn_byte(lwnContext * context, u8 b) {
+  u8 bit;
+
+  for(bit = 0x80; bit != 0; bit >>= 1) {
+    LWN_WRITE(context->clkClr, context->clkMask);
+    if(b & bit)
+      LWN_WRITE(context->dataSet, context->dataMask);
+    else
+      LWN_WRITE(context->dataClr, context->dataMask);
+    LWN_WRITE(context->clkSet, context->clkMask);	// strips take the bit on the rising edge
+  }
+  LWN_WRITE(context->clkClr, context->clkMask);
+}
+
+// 0 if a pin is on a port this chip doesn't have, the strip stays dark
+u8 lwn_setup(lwnContext * context, u32 segFirst, u32 segLeds) {
+  u8 ok;
+
+  pinmode(context->data_pin, OUTPUT);
+  pinmode(context->clk_pin, OUTPUT);
+  ok = lwn_port(context->data_pin, &context->dataSet, &context->dataClr, &context->dataMask);
+  ok &= lwn_port(context->clk_pin, &context->clkSet, &context->clkClr, &context->clkMask);
+  LWN_WRITE(context->clkClr, context->clkMask);
+
+  context->state = LWN_S_WRITE;
+  // start with the latch zeros to wake-up latch(s)
+  context->segStart = segFirst * 3;
+  context->segEnd = (segFirst + segLeds) * 3;
+  context->pixelIndex = LEDS * 3;
+  context->spanEnd = LEDS * 3 + ZEROS_FOR(segLeds);
+  context->seq = FB_SEQ_NONE;
+  context->slot = fb_attach();
+  context->framesSent = 0;
+  start_ms_timer(&context->keepalive, LW_KEEPALIVE_MS);
+  return ok;
+}
+
+// one byte. Returns 0 once the strip is up to date.
+u8 lwn_process(lwnContext * context) {
+  if(context->state == LWN_S_WAIT_FOR_FRAME) {
+    if(!lw_frame_due(context->writer, &context->slot, &context->seq, &context->keepalive,
+                     context->segStart, context->segEnd, &context->spanEnd)) {
+      // strip is up to date
+      return 0;
+    }
+    context->pixelIndex = context->segStart;
+    context->framesSent++;
+    context->state = LWN_S_WRITE;
+  }
+
+  lwn_byte(context, FB_WIRE_BYTE(frame_buff[context->slot], context->pixelIndex));
+
+  // after the last latch byte continue with the newest frame
+  if(++context->pixelIndex == context->spanEnd &&
+     !lw_next_span(&context->pixelIndex, &context->spanEnd, context->segStart))
+    context->state = LWN_S_WAIT_FOR_FRAME;
+  return 1;
+}
+
+// the scheduler's tasks for the two strips
+u8 lwn34_process() {
+  return lwn_process(&pin34Context);
+}
+
+u8 lwn56_process() {
+  return lwn_process(&pin56Context);
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////
+// LED-Strip Writer (parallel soft SPI)
+//////////////////////////////////////////////////////////////////////////////////
+#ifdef PARALLEL_SPI
+// Bit-slices one byte of 8 strips, in[s * stride] is the byte of strip s:
+// bit s of out[k] is bit 7 - k of strip s, so out[0] goes out first.
+// 8x8 bit matrix transpose from Hacker's Delight, 7.3.
+void lwp_transpose8(const u8 *in, u32 stride, u8 *out) {
+  u32 x, y, t;
+
+  // strip 7 in the top byte of x, strip 0 in the low byte of y
+  x = (in[7 * stride] << 24) | (in[6 * stride] << 16) | (in[5 * stride] << 8) | in[4 * stride];
+  y = (in[3 * stride] << 24) | (in[2 * stride] << 16) | (in[1 * stride] << 8) | in[0];
+
+  t = (x ^ (x >> 7)) & 0x00AA00AA;  x = x ^ t ^ (t << 7);
+  t = (y ^ (y >> 7)) & 0x00AA00AA;  y = y ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC; x = x ^ t ^ (t << 14);
+  t = (y ^ (y >> 14)) & 0x0000CCCC; y = y ^ t ^ (t << 14);
+
+  t = (x & 0xF0F0F0F0) | ((y >> 4) & 0x0F0F0F0F);
+  y = ((x << 4) & 0xF0F0F0F0) | (y & 0x0F0F0F0F);
+  x = t;
+
+  out[0] = x >> 24; out[1] = x >> 16; out[2] = x >> 8; out[3] = x;
+  out[4] = y >> 24; out[5] = y >> 16; out[6] = y >> 8; out[7] = y;
+}
+
+// port bits for the 8 clocks of a byte of every strip, MSB first.
+// index is the wire byte of the first strip.
+void lwp_bit_planes(const u8 *frame, u32 index, u32 *planes) {
+  u8 lo[8];
+  u8 k;
+#if LWP_STRIPS > 8
+  u8 hi[8];
+  u8 extra[8];
+
+  for(k = 0; k < 8; k++)
+    extra[k] = (k < LWP_STRIPS - 8) ? FB_WIRE_BYTE(frame, (8 + k) * LWP_STRIP_BYTES + index) : 0x00;
+  lwp_transpose8(extra, 1, hi);
+#endif
+#if LWP_STRIPS < 8 || FRAME_FORMAT != FRAME_WIRE
+  for(k = 0; k < 8; k++)
+    lo[k] = (k < LWP_STRIPS) ? FB_WIRE_BYTE(frame, k * LWP_STRIP_BYTES + index) : 0x00;
+  lwp_transpose8(lo, 1, lo);
+#else
+  lwp_transpose8(frame + index, LWP_STRIP_BYTES, lo);
+#endif
+
+  for(k = 0; k < 8; k++) {
+#if LWP_STRIPS > 8
+    planes[k] = ((u32)lo[k] | ((u32)hi[k] << 8)) << LWP_DATA_SHIFT;
+#else
+    planes[k] = (u32)lo[k] << LWP_DATA_SHIFT;
+#endif
+  }
+}
+
+// clock 8 bits out on all strips at once
+void lwp_shift(const u32 *planes) {
+  u8 k;
+
+  for(k = 0; k < 8; k++) {
+    LWP_CLK_LATCLR = LWP_CLK_MASK;
+    LWP_DATA_LATCLR = LWP_DATA_MASK & ~planes[k];
+    LWP_DATA_LATSET = planes[k];
+    LWP_CLK_LATSET = LWP_CLK_MASK;		// strips take the bit on the rising edge
+  }
+  LWP_CLK_LATCLR = LWP_CLK_MASK;
+}
+
+void lwp_setup() {
+  LWP_DATA_LATCLR = LWP_DATA_MASK;
+  LWP_CLK_LATCLR = LWP_CLK_MASK;
+  LWP_DATA_TRISCLR = LWP_DATA_MASK;
+  LWP_CLK_TRISCLR = LWP_CLK_MASK;
+
+  // start with the latch zeros to wake-up latch(s)
+  lwp_state = LW_S_WAIT_TO_WRITE_ZEROS;
+  lwp_byteIndex = LEDS * 3;
+  lwp_spanEnd = LEDS * 3 + ZEROS_FOR(LWP_STRIP_LEDS);
+  lwp_seq = FB_SEQ_NONE;
+  lwp_slot = fb_attach();
+  lwp_framesSent = 0;
+  start_ms_timer(&lwp_keepalive, LW_KEEPALIVE_MS);
+}
+
+// one byte on every strip per call. Returns 0 once the strips are up to date.
+u8 lwp_process() {
+  u32 planes[8];
+  u8 k;
+
+  if(lwp_state == LW_S_WAIT_FOR_FRAME) {
+    if(!lw_frame_due(FB_W_PARALLEL, &lwp_slot, &lwp_seq, &lwp_keepalive,
+                     LWP_SEG_FIRST * 3, (LWP_SEG_FIRST + LWP_SEG_LEDS) * 3, &lwp_spanEnd)) {
+      // strips are up to date
+      return 0;
+    }
+    // strips go in lock step, the longest prefix of all strips is at most one strip
+    lwp_spanEnd -= LWP_SEG_FIRST * 3;
+    if(lwp_spanEnd > LWP_STRIP_BYTES)
+      lwp_spanEnd = LWP_STRIP_BYTES;
+    lwp_byteIndex = 0;
+    lwp_framesSent++;
+    lwp_state = LW_S_WAIT_TO_WRITE_PIXEL;
+  }
+
+  if(lwp_state == LW_S_WAIT_TO_WRITE_PIXEL) {
+    lwp_bit_planes(frame_buff[lwp_slot], LWP_SEG_FIRST * 3 + lwp_byteIndex, planes);
+  } else {
+    for(k = 0; k < 8; k++)
+      planes[k] = 0;
+  }
+  lwp_shift(planes);
+
+  if(++lwp_byteIndex == lwp_spanEnd) {
+    if(lw_next_span(&lwp_byteIndex, &lwp_spanEnd, 0))
+      lwp_state = LW_S_WAIT_TO_WRITE_ZEROS;
+    else
+      lwp_state = LW_S_WAIT_FOR_FRAME;
+  }
+  return 1;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////
+// Statistics
+//////////////////////////////////////////////////////////////////////////////////
+// the totals now, STATS_* order
+void stats_sample(u32 *total) {
+  u8 i;
+
+  for(i = 0; i < STATS_COUNTERS; i++)
+    total[i] = 0;
+#ifdef LW_STREAM
+  // every frame goes on to the wire as it comes
+  total[STATS_FRAMES] = lws_framesSent;
+  total[STATS_SPI] = lws_framesSent;
+#else
+  total[STATS_FRAMES] = fb_received;
+  total[STATS_SWAPS] = fb_swaps;
+  total[STATS_SUPERSEDED] = fb_superseded;
+  total[STATS_DROPPED] = fb_dropped + fb_lateDropped;
+  total[STATS_SPI] = lw_framesSent;
+#endif
+  total[STATS_BYTES_IN] = dl_bytesIn;
+  total[STATS_BYTES_OUT] = dl_bytesOut;
+  total[STATS_TIMEOUTS] = dl_timeouts;
+  total[STATS_OVERFLOWS] = dl_ringOverflows;
+#ifdef PARALLEL_SPI
+  total[STATS_PARALLEL] = lwp_framesSent;
+#endif
+#ifdef SOFT_SPI
+  total[STATS_PIN34] = pin34Context.framesSent;
+  total[STATS_PIN56] = pin56Context.framesSent;
+#endif
+}
+
+void stats_setup() {
+  u8 i;
+
+  stats_sample(stats_last);
+  for(i = 0; i < STATS_COUNTERS; i++)
+    stats_rate[i] = 0;
+  stats_lastUs = time_us();
+  start_ms_timer(&stats_timer, STATS_MS);
+}
+
+// every STATS_MS: the rates since the last sample. A loop that fell behind
+// makes the period longer, the rates are per second of it.
+u8 stats_process() {
+  u32 total[STATS_COUNTERS];
+  u64 now;
+  u32 us;
+  u8 i;
+
+  if(!check_timer(&stats_timer))
+    return 0;
+  repeat_ms_timer(&stats_timer, STATS_MS);
+  now = time_us();
+  us = now - stats_lastUs;
+  stats_lastUs = now;
+  stats_sample(total);
+  for(i = 0; i < STATS_COUNTERS; i++) {
+    stats_rate[i] = us ? (u64)(total[i] - stats_last[i]) * 1000000 / us : 0;
+    stats_last[i] = total[i];
+  }
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// CDC transmit
+//////////////////////////////////////////////////////////////////////////////////
+void cdc_tx_setup() {
+  cdc_txHead = 0;
+  cdc_txTail = 0;
+  cdc_txBusy = 0;
+  cdc_txHighWater = 0;
+  cdc_txDropped = 0;
+}
+
+// queue n bytes for the host, all or none. Returns 0 if they were dropped.
+u8 cdc_write(const u8 *data, u32 n) {
+  u32 used = cdc_txHead - cdc_txTail;
+  u32 i;
+
+  if(CDC_TX_SIZE - used < n) {
+    cdc_txDropped++;
+    return 0;
+  }
+  for(i = 0; i < n; i++)
+    cdc_txRing[(cdc_txHead + i) & (CDC_TX_SIZE - 1)] = data[i];
+  cdc_txHead += n;
+  used += n;
+  if(used > cdc_txHighWater)
+    cdc_txHighWater = used;
+  return 1;
+}
+
+u8 cdc_print(const char *text) {
+  u32 n = 0;
+
+  while(text[n] != 0)
+    n++;
+  return cdc_write((const u8 *)text, n);
+}
+
+// give USB the next span once it is done with the last one. It sends from
+// the ring, so the span stays there until then.
+u8 cdc_tx_process() {
+  u32 pos, span;
+
+  if(cdc_txBusy == 0 && cdc_txHead == cdc_txTail)
+    return 0;
+  // CDC is not reentrant, keep the receive interrupt out
+  IntDisable(INT_TIMER5);
+  if(cdc_txBusy != 0 && USBUSARTIsTxTrfReady()) {
+    cdc_txTail += cdc_txBusy;
+    cdc_txBusy = 0;
+  }
+  if(cdc_txBusy == 0 && cdc_txHead != cdc_txTail) {
+    pos = cdc_txTail & (CDC_TX_SIZE - 1);
+    span = cdc_txHead - cdc_txTail;
+    if(span > CDC_TX_SIZE - pos)
+      span = CDC_TX_SIZE - pos;
+    if(span > CDC_TX_CHUNK)
+      span = CDC_TX_CHUNK;
+    putUSBUSART((char *)cdc_txRing + pos, span);
+    cdc_txBusy = span;
+  }
+  CDCTxService();
+  IntEnable(INT_TIMER5);
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// DataLink
+//////////////////////////////////////////////////////////////////////////////////
+// receive ring producer, interrupt context: move one packet from the CDC
+// endpoint to the ring. Without room for a full packet it stays in the
+// endpoint and USB holds the host off.
+void dl_rx_poll() {
+  u32 head = dl_ringHead;
+  u32 used = head - dl_ringTail;
+  u32 pos, n, i;
+
+#ifdef DL_DIRECT
+  // nothing queued ahead of it: the packet goes straight into the back buffer,
+  // as long as it can't run past the frame
+  pos = dl_directPos;
+  if(used == 0 && FRAME_PIXEL_BYTES - pos >= DL_PACKET) {
+    n = CDCgets((char *)pixels + pos);
+    DL_BARRIER();
+    dl_directPos = pos + n;
+    dl_bytesIn += n;
+    return;
+  }
+#endif
+
+  if(DL_RING_SIZE - used < DL_PACKET) {
+    dl_ringOverflows++;
+    return;
+  }
+  pos = head & (DL_RING_SIZE - 1);
+  n = CDCgets((char *)dl_ring + pos);
+  if(n == 0)
+    return;
+  dl_bytesIn += n;
+  for(i = DL_RING_SIZE; i < pos + n; i++)
+    dl_ring[i - DL_RING_SIZE] = dl_ring[i];
+
+  DL_BARRIER();		// bytes first, then the head that publishes them
+  dl_ringHead = head + n;
+  used += n;
+  if(used > dl_ringHighWater)
+    dl_ringHighWater = used;
+}
+
+void Tmr5Interrupt(void) {
+#ifdef PROFILE
+  u32 start = GetCP0Count();
+#endif
+
+  if(IntGetFlag(INT_TIMER5)) {
+    dl_rx_poll();
+    IntClearFlag(INT_TIMER5);
+  }
+  PROF_ADD(PROF_RX, GetCP0Count() - start);
+}
+
+#ifndef LW_STREAM
+// encode to wire format: LPD8806 wants the high bit set on every color byte.
+// Goes a word at a time where the data is aligned.
+void dl_encode(u8 *data, u32 n) {
+  u32 *words;
+
+  while(n > 0 && ((u32)data & 3)) {
+    *data++ |= 0x80;
+    n--;
+  }
+  words = (u32 *)data;
+  for(; n >= 4; n -= 4)
+    *words++ |= 0x80808080;
+  data = (u8 *)words;
+  while(n-- > 0)
+    *data++ |= 0x80;
+}
+
+// chain position of pixel x of the host's row y
+u32 dl_map_pixel(u32 x, u32 y) {
+  dlGeometry *g = &dl_geometry;
+  u32 px, py;
+  u8 reversed;
+
+  if(g->flags & DL_G_MIRROR)
+    x = ((g->rotation & 1) ? g->height : g->width) - 1 - x;
+
+  switch(g->rotation) {
+  case 1:
+    // rotation cw 90, width => height, height => width
+    px = g->width - 1 - y;
+    py = x;
+    break;
+  case 2:
+    // rotation cw 180, start from the bottom
+    px = g->width - 1 - x;
+    py = g->height - 1 - y;
+    break;
+  case 3:
+    px = y;
+    py = g->height - 1 - x;
+    break;
+  default:
+    px = x;
+    py = y;
+    break;
+  }
+
+  reversed = (g->flags & DL_G_REVERSED) != 0;
+  if((g->flags & DL_G_SERPENTINE) && (py & 1))
+    reversed = !reversed;
+  return py * g->width + (reversed ? g->width - 1 - px : px);
+}
+
+// the host's pixels are in dl_map: append the LEDs none of them lands on, in
+// chain order, and see if the map changes anything
+void dl_map_finish() {
+  u8 used[(LEDS + 7) / 8];
+  u32 i, n;
+
+  for(i = 0; i < sizeof(used); i++)
+    used[i] = 0;
+  for(i = 0; i < dl_pixels; i++)
+    used[dl_map[i] >> 3] |= 1 << (dl_map[i] & 7);
+  n = dl_pixels;
+  for(i = 0; i < LEDS && n < LEDS; i++) {
+    if(!(used[i >> 3] & (1 << (i & 7))))
+      dl_map[n++] = i;
+  }
+
+  dl_identity = 1;
+  for(i = 0; i < LEDS; i++) {
+    if(dl_map[i] != i)
+      dl_identity = 0;
+  }
+#if FRAME_FORMAT == FRAME_WIRE
+  // wire frames take the colors as they are, too
+  for(i = 0; i < 3; i++) {
+    if(colorOffsetMap[i] != i)
+      dl_identity = 0;
+  }
+#endif
+
+  // the newest frame is no base for deltas on another map
+  dl_newestValid = 0;
+}
+
+// map the host's image as dl_geometry says
+void dl_map_geometry() {
+  u32 hostWidth = (dl_geometry.rotation & 1) ? dl_geometry.height : dl_geometry.width;
+  u32 x, y, i = 0;
+
+  dl_pixels = dl_geometry.width * dl_geometry.height;
+  for(y = 0; i < dl_pixels; y++) {
+    for(x = 0; x < hostWidth; x++)
+      dl_map[i++] = dl_map_pixel(x, y);
+  }
+  dl_map_finish();
+}
+
+// order: wire byte of red, green and blue
+void dl_set_colors(const u8 *order) {
+  u8 i;
+#if FRAME_FORMAT == FRAME_INDEXED
+  u32 index;
+  u8 rgb[3];
+
+  // the palette is kept as wire bytes, move its colors along
+  for(index = 0; index < 256; index++) {
+    for(i = 0; i < 3; i++)
+      rgb[i] = fb_palette[index][colorOffsetMap[i]];
+    for(i = 0; i < 3; i++)
+      fb_palette[index][order[i]] = rgb[i];
+  }
+#endif
+  for(i = 0; i < 3; i++)
+    colorOffsetMap[i] = order[i];
+#if FRAME_FORMAT == FRAME_RGB565
+  for(i = 0; i < 3; i++)
+    fb_wireChannel[colorOffsetMap[i]] = i;
+#endif
+}
+
+// the geometry of the compile time switches
+void dl_map_setup() {
+#ifdef RAW_LAYOUT
+  u8 wireOrder[3] = { 0, 1, 2 };
+
+  // chain order, wire colors
+  dl_set_colors(wireOrder);
+  dl_geometry.rotation = 0;
+  dl_geometry.flags = 0;
+#else
+#if defined ROTATE_CW_90
+  dl_geometry.rotation = 1;
+#elif defined ROTATE_CW_180
+  dl_geometry.rotation = 2;
+#else
+  dl_geometry.rotation = 0;
+#endif
+  dl_geometry.flags = DL_G_SERPENTINE;
+#endif
+  dl_geometry.width = L_WIDTH;
+  dl_geometry.height = L_HEIGHT;
+  dl_map_geometry();
+}
+
+#endif
+
+// start receiving the next frame from its first byte
+void dl_reset_frame() {
+#ifdef LW_STREAM
+  lws_restart();
+#else
+  writeColByte = 0;
+  writePixel = 0;
+  writeDirtyEnd = 0;
+  writeDone = 0;
+#endif
+}
+
+// some of a frame or packet came in and the rest is missing
+u8 dl_partial() {
+#if defined DL_FRAMED
+  return dl_state != DL_P_HUNT;
+#elif defined DL_DIRECT
+  return dl_directPos != 0;
+#elif defined LW_STREAM
+  return lws_leds != 0 || lws_color != 0;
+#else
+  return writePixel != 0 || writeColByte != 0;
+#endif
+}
+
+#ifndef LW_STREAM
+// store the bytes of the pixels in the pixel buffer in the frame format, in the
+// order the host sends them
+void dl_store(const u8 *data, u32 n) {
+  u32 i;
+  u32 insertPos;
+  u8 b;
+  u8 *reference = frame_buff[fb_newest];	// previous frame, to find what changed
+
+  for(i = 0; i < n; i++) {
+    if(writeColByte == 0) {
+      // next pixel
+      writePixelPos = dl_map[writePixel] * FB_LED_BYTES;
+    }
+#if FRAME_FORMAT == FRAME_WIRE
+    insertPos = writePixelPos + colorOffsetMap[writeColByte];
+    b = data[i] | 0x80;
+#else
+    insertPos = writePixelPos + writeColByte;
+    b = data[i];
+#endif
+
+    /*DEBUG*///CDCprintf("pixel: %d, byte: %d = %d\n", writePixel, writeColByte, insertPos);
+
+    if(insertPos >= writeDirtyEnd && reference[insertPos] != b)
+      writeDirtyEnd = insertPos + 1;
+    pixels[insertPos] = b;
+
+    // incerement counters
+    if(++writeColByte < FB_LED_BYTES)
+      continue;
+    // reset color-byte-counter, go to next pixel
+    writeColByte = 0;
+    if(++writePixel < dl_pixels)
+      continue;
+    // We're at the end of the buffer - framed, the packet's CRC decides if it goes out
+#ifndef DL_FRAMED
+    /*DEBUG*///CDCprintf("Received an image, switching buffers - READY!\n");
+    fb_present(writeDirtyEnd, 0, 0);
+    pixels = fb_acquire();
+    reference = frame_buff[fb_newest];
+    dl_reset_frame();
+#endif
+  }
+}
+
+// the first pos bytes of the frame are in the back buffer: encode and compare
+// the ones after writeDone in place
+void dl_raw_commit(u32 pos) {
+  u8 *reference = frame_buff[fb_newest];
+
+#if FRAME_FORMAT == FRAME_WIRE
+  dl_encode(pixels + writeDone, pos - writeDone);
+#endif
+  for(; writeDone < pos; writeDone++) {
+    if(pixels[writeDone] != reference[writeDone])
+      writeDirtyEnd = writeDone + 1;
+  }
+}
+#endif
+
+#ifdef DL_DIRECT
+// the back buffer holds dl_directPos bytes of the frame, the ones the
+// interrupt put there directly still need their encoding
+void dl_raw_process() {
+  u32 tail = dl_ringTail;
+  u32 n = dl_ringHead - tail;
+  u32 pos = dl_directPos;
+  u32 span;
+
+  // queued packets: the interrupt stays out of the back buffer until the ring
+  // is empty. With nothing queued it may be writing there, dl_directPos is
+  // its own then.
+  if(n > FRAME_PIXEL_BYTES - pos)
+    n = FRAME_PIXEL_BYTES - pos;
+  if(n > 0) {
+    while(n > 0) {
+      span = DL_RING_SIZE - (tail & (DL_RING_SIZE - 1));
+      if(span > n)
+        span = n;
+      for(; span > 0; span--, n--)
+        pixels[pos++] = dl_ring[tail++ & (DL_RING_SIZE - 1)];
+    }
+    dl_directPos = pos;
+    DL_BARRIER();
+    dl_ringTail = tail;
+  }
+
+  dl_raw_commit(pos);
+
+  if(pos == FRAME_PIXEL_BYTES) {
+    // complete - the interrupt doesn't touch a full frame, swap and reopen
+    fb_present(writeDirtyEnd, 0, 0);
+    pixels = fb_acquire();
+    dl_reset_frame();
+    DL_BARRIER();
+    dl_directPos = 0;
+  }
+}
+#endif
+
+#ifdef DL_FRAMED
+// CRC-32, reflected polynomial 0xEDB88320, a nibble at a time
+const u32 dl_crcTable[16] = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+u32 dl_crc_update(u32 crc, const u8 *data, u32 n) {
+  while(n-- > 0) {
+    crc ^= *data++;
+    crc = (crc >> 4) ^ dl_crcTable[crc & 0x0F];
+    crc = (crc >> 4) ^ dl_crcTable[crc & 0x0F];
+  }
+  return crc;
+}
+
+// look for the next magic
+void dl_hunt() {
+  dl_state = DL_P_HUNT;
+  dl_matched = 0;
+}
+
+// LW_STREAM: the payload of a packet with a good header is not kept, it goes
+// on as it comes in
+u8 dl_passed_on() {
+#ifdef LW_STREAM
+  return dl_state == DL_P_PAYLOAD || dl_state == DL_P_CRC;
+#else
+  return 0;
+#endif
+}
+
+// the packet at dl_packetStart is bad. Its bytes are still in the ring: search
+// them from the byte after its magic, a header the bad length swallowed is found again.
+void dl_resync() {
+  if(!dl_passed_on())
+    dl_parsePos = dl_packetStart + 1;
+  dl_hunt();
+}
+
+// header is in dl_hdr: 0 if no sender would send it
+u8 dl_header_ok() {
+  u32 len;
+
+  dl_type = dl_hdr[0];
+  dl_id = dl_hdr[2] | (dl_hdr[3] << 8);
+  dl_len = dl_hdr[4] | (dl_hdr[5] << 8);
+  dl_timed = (dl_hdr[1] & DL_F_PTS) != 0;
+  dl_ptsLeft = dl_timed ? DL_PTS_BYTES : 0;
+  dl_pts = 0;
+
+  if(dl_len > DL_MAX_PAYLOAD || dl_len < dl_ptsLeft)
+    return 0;
+  if(dl_timed && dl_type != DL_T_FRAME && dl_type != DL_T_RLE && dl_type != DL_T_DELTA)
+    return 0;
+  // the frame after the presentation time
+  len = dl_len - dl_ptsLeft;
+  switch(dl_type) {
+  case DL_T_FRAME:
+#ifdef LW_STREAM
+    if(len != LEDS * 3)
+#else
+    if(len != dl_pixels * FB_LED_BYTES)
+#endif
+      return 0;
+    dl_reset_frame();
+    break;
+  case DL_T_RLE:
+  case DL_T_DELTA:
+    dl_reset_frame();
+    dl_decoded = 0;
+    dl_codecBad = 0;
+    dl_fill = 0;
+    dl_word = 0;
+    dl_codecState = (dl_type == DL_T_DELTA) ? DL_C_BASE : DL_C_OP;
+    break;
+  case DL_T_PALETTE:
+    if(dl_len < 4 || dl_len > 1 + 256 * 3 || (dl_len - 1) % 3 != 0)
+      return 0;
+    break;
+  case DL_T_GEOMETRY:
+    if(dl_len != 0 && dl_len != DL_GEOMETRY_BYTES)
+      return 0;
+    break;
+  case DL_T_MAP:
+    if(dl_len < 4 || dl_len % 2 != 0)
+      return 0;
+    break;
+  case DL_T_CLOCK:
+    if(dl_len != 0 && dl_len != 4)
+      return 0;
+    break;
+  case DL_T_PROFILE:
+    if(dl_len > 1)
+      return 0;
+    break;
+  case DL_T_STATS:
+    if(dl_len != 0)
+      return 0;
+    break;
+  }
+  return 1;
+}
+
+// byte i of the payload of the current packet, it stays in the ring until the packet is done
+u8 dl_payload(u32 i) {
+  return dl_ring[(dl_packetStart + DL_HEADER + i) & (DL_RING_SIZE - 1)];
+}
+
+u32 dl_payload_len() {
+  return dl_hdr[4] | (dl_hdr[5] << 8);
+}
+
+#ifndef LW_STREAM
+// the next pixel bytes of the frame, in the host's layout
+void dl_put(const u8 *data, u32 n) {
+  u32 i;
+
+  if(!dl_identity) {
+    dl_store(data, n);
+    return;
+  }
+  for(i = 0; i < n; i++)
+    pixels[writeDone + i] = data[i];
+  dl_raw_commit(writeDone + n);
+}
+
+// the next n pixels of the frame stay as in the newest one
+void dl_keep(u32 n) {
+  u8 *reference = frame_buff[fb_newest];
+  u32 pos, i;
+
+  if(dl_identity) {
+    for(n *= FB_LED_BYTES; n > 0; n--, writeDone++)
+      pixels[writeDone] = reference[writeDone];
+    return;
+  }
+  for(; n > 0; n--) {
+    pos = dl_map[writePixel++] * FB_LED_BYTES;
+    for(i = 0; i < FB_LED_BYTES; i++)
+      pixels[pos + i] = reference[pos + i];
+  }
+}
+
+// Decodes DL_T_RLE and DL_T_DELTA payload, whole pixels in the host's layout.
+// An op is a byte c and its pixels:
+//   c < 0x80   c + 1 pixels follow, FB_LED_BYTES each
+//   c >= 0x80  one pixel follows, it repeats (c & 0x7F) + 1 times
+// DL_T_RLE is ops until the frame is full. DL_T_DELTA is the u16 id of the
+// frame it changes, then pairs of u16 skip and one op: skip pixels stay as they
+// are. The pixels after the last pair stay, too.
+void dl_decode(const u8 *data, u32 n) {
+  u32 run, count;
+  u8 b;
+
+  while(n > 0 && dl_codecBad == 0) {
+    if(dl_codecState == DL_C_LITERAL) {
+      run = (n < dl_opLeft) ? n : dl_opLeft;
+      dl_put(data, run);
+      data += run;
+      n -= run;
+      dl_opLeft -= run;
+      if(dl_opLeft == 0)
+        dl_codecState = (dl_type == DL_T_DELTA) ? DL_C_SKIP : DL_C_OP;
+      continue;
+    }
+
+    b = *data++;
+    n--;
+
+    switch(dl_codecState) {
+    case DL_C_BASE:
+    case DL_C_SKIP:
+      dl_word |= b << (8 * dl_fill);
+      if(++dl_fill < 2)
+        break;
+      if(dl_codecState == DL_C_BASE) {
+        if(!dl_newestValid || dl_word != dl_newestId)
+          dl_codecBad = DL_NACK_BASE;
+        dl_codecState = DL_C_SKIP;
+      } else {
+        if(dl_decoded + dl_word > dl_pixels) {
+          dl_codecBad = DL_NACK_DATA;
+          break;
+        }
+        dl_keep(dl_word);
+        dl_decoded += dl_word;
+        dl_codecState = DL_C_OP;
+      }
+      dl_fill = 0;
+      dl_word = 0;
+      break;
+
+    case DL_C_OP:
+      count = (b & 0x7F) + 1;
+      if(dl_decoded + count > dl_pixels) {
+        dl_codecBad = DL_NACK_DATA;
+        break;
+      }
+      dl_decoded += count;
+      if(b & 0x80) {
+        dl_opLeft = count;
+        dl_fill = 0;
+        dl_codecState = DL_C_RUN;
+      } else {
+        dl_opLeft = count * FB_LED_BYTES;
+        dl_codecState = DL_C_LITERAL;
+      }
+      break;
+
+    case DL_C_RUN:
+      dl_runPixel[dl_fill] = b;
+      if(++dl_fill < FB_LED_BYTES)
+        break;
+      for(; dl_opLeft > 0; dl_opLeft--)
+        dl_put(dl_runPixel, FB_LED_BYTES);
+      dl_fill = 0;
+      dl_codecState = (dl_type == DL_T_DELTA) ? DL_C_SKIP : DL_C_OP;
+      break;
+    }
+  }
+}
+#endif
+
+// payload bytes of the current packet, not checked yet
+void dl_packet_data(const u8 *data, u32 n) {
+  // the presentation time comes first
+  for(; n > 0 && dl_ptsLeft > 0; n--, dl_ptsLeft--)
+    dl_pts |= (u32)*data++ << (8 * (DL_PTS_BYTES - dl_ptsLeft));
+
+  switch(dl_type) {
+  case DL_T_FRAME:
+#ifdef LW_STREAM
+    lws_put(data, n);
+#else
+    dl_put(data, n);
+#endif
+    break;
+#ifndef LW_STREAM
+  case DL_T_RLE:
+  case DL_T_DELTA:
+    dl_decode(data, n);
+    break;
+#endif
+  }
+}
+
+// send a packet to the host, len up to DL_MAX_REPLY. It is queued whole or,
+// if the transmit ring is full, dropped; its id is used up either way.
+void dl_send(u8 type, const u8 *payload, u8 len) {
+  u8 packet[DL_HEADER + DL_MAX_REPLY + DL_TRAILER];
+  u32 crc;
+  u8 i;
+
+  for(i = 0; i < 4; i++)
+    packet[i] = dl_magic[i];
+  packet[4] = type;
+  packet[5] = 0;
+  packet[6] = dl_txId;
+  packet[7] = dl_txId >> 8;
+  packet[8] = len;
+  packet[9] = 0;
+  for(i = 0; i < len; i++)
+    packet[DL_HEADER + i] = payload[i];
+  crc = ~dl_crc_update(0xFFFFFFFF, packet + 4, DL_HEADER - 4 + len);
+  for(i = 0; i < DL_TRAILER; i++)
+    packet[DL_HEADER + len + i] = crc >> (8 * i);
+  dl_txId++;
+
+  if(cdc_write(packet, DL_HEADER + len + DL_TRAILER))
+    dl_bytesOut += DL_HEADER + len + DL_TRAILER;
+}
+
+// first id the host may not send yet
+u16 dl_credit_limit() {
+#ifdef LW_STREAM
+  // one frame at a time, it goes on as it comes in and waits nowhere
+  return dl_creditBase + 1;
+#else
+  // one for every free place in the queue, the frame after them would take
+  // the place of the last one
+  return dl_creditBase + fb_room();
+#endif
+}
+
+void dl_send_credit() {
+  u8 payload[2];
+
+  dl_creditSent = dl_credit_limit();
+  payload[0] = dl_creditSent;
+  payload[1] = dl_creditSent >> 8;
+  dl_send(DL_T_CREDIT, payload, 2);
+}
+
+// tell the host when a packet or a writer made room
+void dl_credit_process() {
+  if(!dl_creditNews)
+    return;
+  dl_creditNews = 0;
+  // the limit only grows, ids wrap around
+  if((s16)(dl_credit_limit() - dl_creditSent) > 0)
+    dl_send_credit();
+}
+
+#ifndef LW_STREAM
+// fb_notify() handler: a frame left the queue
+void dl_on_free() {
+  dl_creditNews = 1;
+}
+#endif
+
+void dl_send_nack(u8 reason) {
+  u8 payload[3];
+
+  payload[0] = dl_id;
+  payload[1] = dl_id >> 8;
+  payload[2] = reason;
+  dl_send(DL_T_NACK, payload, 3);
+}
+
+void dl_put_u32(u8 *out, u32 value) {
+  out[0] = value;
+  out[1] = value >> 8;
+  out[2] = value >> 16;
+  out[3] = value >> 24;
+}
+
+// DL_T_CLOCK: a u32 sets the device clock. With or without it the device
+// answers with its clock, then the frames queued, FB_QUEUE and the u32 counts
+// of frames superseded, late and dropped late, and the most us a frame was late.
+// The host times its frames for DL_F_PTS by it.
+void dl_clock_done() {
+  u8 payload[22];
+
+  if(dl_payload_len() == 4)
+    clock_set(dl_payload(0) | (dl_payload(1) << 8) | ((u32)dl_payload(2) << 16) | ((u32)dl_payload(3) << 24));
+  dl_put_u32(payload, clock_us());
+#ifdef LW_STREAM
+  // frames aren't queued, they go out as they come
+  dl_send(DL_T_CLOCK, payload, 4);
+#else
+  payload[4] = fb_queued;
+  payload[5] = FB_QUEUE;
+  dl_put_u32(payload + 6, fb_superseded);
+  dl_put_u32(payload + 10, fb_late);
+  dl_put_u32(payload + 14, fb_lateDropped);
+  dl_put_u32(payload + 18, fb_lateMax);
+  dl_send(DL_T_CLOCK, payload, sizeof(payload));
+#endif
+}
+
+#ifdef PROFILE
+// DL_T_PROFILE: two replies per probe. First u8 probe, u8 0, the name in 8
+// bytes and the u32 calls, min, avg and max CP0 counts, then u8 probe, u8 1
+// and the PROF_BINS bins of its histogram as u16, full ones stay at 0xFFFF.
+// A payload byte 1 clears the figures after sending them.
+void dl_profile_done() {
+  u8 payload[2 + 2 * PROF_BINS];
+  profProbe *probe;
+  const char *name;
+  u32 n;
+  u8 i, k;
+
+  for(i = 0; i < PROF_PROBES; i++) {
+    name = prof_name(i);
+    if(name == 0)
+      continue;
+    probe = &prof[i];
+    payload[0] = i;
+    payload[1] = 0;
+    for(k = 0; k < 8; k++)
+      payload[2 + k] = *name ? *name++ : 0;
+    dl_put_u32(payload + 10, probe->calls);
+    dl_put_u32(payload + 14, probe->calls ? probe->min : 0);
+    dl_put_u32(payload + 18, probe->calls ? probe->sum / probe->calls : 0);
+    dl_put_u32(payload + 22, probe->max);
+    dl_send(DL_T_PROFILE, payload, 26);
+
+    payload[1] = 1;
+    for(k = 0; k < PROF_BINS; k++) {
+      n = probe->bins[k] > 0xFFFF ? 0xFFFF : probe->bins[k];
+      payload[2 + 2 * k] = n;
+      payload[3 + 2 * k] = n >> 8;
+    }
+    dl_send(DL_T_PROFILE, payload, sizeof(payload));
+  }
+  if(dl_payload_len() == 1 && dl_payload(0) == 1)
+    prof_clear();
+}
+#endif
+
+// DL_T_STATS: two replies, u8 0, u8 STATS_COUNTERS and the u32 totals in
+// STATS_* order, then u8 1, u8 STATS_COUNTERS and their rates per second over
+// the last STATS_MS.
+void dl_stats_done() {
+  u8 payload[2 + 4 * STATS_COUNTERS];
+  u32 total[STATS_COUNTERS];
+  u8 i;
+
+  stats_sample(total);
+  payload[0] = 0;
+  payload[1] = STATS_COUNTERS;
+  for(i = 0; i < STATS_COUNTERS; i++)
+    dl_put_u32(payload + 2 + 4 * i, total[i]);
+  dl_send(DL_T_STATS, payload, sizeof(payload));
+
+  payload[0] = 1;
+  for(i = 0; i < STATS_COUNTERS; i++)
+    dl_put_u32(payload + 2 + 4 * i, stats_rate[i]);
+  dl_send(DL_T_STATS, payload, sizeof(payload));
+}
+
+#ifndef LW_STREAM
+// the back buffer holds the frame of the current packet
+void dl_frame_done() {
+  u32 fence;
+
+  // the LEDs the host doesn't cover stay
+  dl_keep(LEDS - dl_pixels);
+  fence = fb_present(writeDirtyEnd, dl_timed, dl_pts);
+  pixels = fb_acquire();
+  if(fence == 0)
+    return;
+  dl_newestId = dl_id;
+  dl_newestValid = 1;
+#ifdef DL_LATCH_NOTICE
+  // the oldest one goes if the host keeps more in flight than we keep track of
+  if(dl_fences == DL_FENCES) {
+    dl_fenceHead = (dl_fenceHead + 1) % DL_FENCES;
+    dl_fences--;
+  }
+  dl_fence[(dl_fenceHead + dl_fences) % DL_FENCES] = fence;
+  dl_fenceId[(dl_fenceHead + dl_fences) % DL_FENCES] = dl_id;
+  dl_fences++;
+#endif
+}
+
+#ifdef DL_LATCH_NOTICE
+// fb_notify() handler, the writers are running: only note it
+void dl_on_latched(u32 fence) {
+  dl_latchNews = 1;
+}
+
+// send the id of the newest frame packet that is latched now
+void dl_latch_process() {
+  u16 id;
+  u8 payload[2];
+  u8 found = 0;
+
+  if(!dl_latchNews)
+    return;
+  dl_latchNews = 0;
+  while(dl_fences > 0 && fb_latched(dl_fence[dl_fenceHead])) {
+    id = dl_fenceId[dl_fenceHead];
+    dl_fenceHead = (dl_fenceHead + 1) % DL_FENCES;
+    dl_fences--;
+    found = 1;
+  }
+  if(!found)
+    return;
+  payload[0] = id;
+  payload[1] = id >> 8;
+  dl_send(DL_T_LATCHED, payload, 2);
+}
+#endif
+
+#if FRAME_FORMAT == FRAME_INDEXED
+// the palette packet is good, its payload is still in the ring
+void dl_palette_done() {
+  u32 len = dl_payload_len();
+  u32 index = dl_payload(0);
+  u32 pos, i;
+  u8 color;
+
+  if(index + (len - 1) / 3 > 256) {
+    dl_send_nack(DL_NACK_DATA);
+    return;
+  }
+  for(pos = 1; pos < len; index++) {
+    for(color = 0; color < 3; color++)
+      fb_palette[index][colorOffsetMap[color]] = dl_payload(pos++) | 0x80;
+  }
+
+  // the writers use it at once, send the newest frame out again in full
+  for(i = 0; i < FRAME_BYTES; i++)
+    pixels[i] = frame_buff[fb_newest][i];
+  fb_present(FRAME_PIXEL_BYTES, 0, 0);
+  pixels = fb_acquire();
+}
+#endif
+
+void dl_send_geometry() {
+  u8 payload[DL_GEOMETRY_BYTES + 3];
+  u8 i;
+
+  payload[0] = dl_geometry.width;
+  payload[1] = dl_geometry.width >> 8;
+  payload[2] = dl_geometry.height;
+  payload[3] = dl_geometry.height >> 8;
+  payload[4] = dl_geometry.rotation;
+  payload[5] = dl_geometry.flags;
+  for(i = 0; i < 3; i++)
+    payload[6 + i] = colorOffsetMap[i];
+  // and what the host can't change
+  payload[9] = LEDS & 0xFF;
+  payload[10] = LEDS >> 8;
+  payload[11] = FRAME_FORMAT;
+  dl_send(DL_T_GEOMETRY, payload, sizeof(payload));
+}
+
+// DL_T_GEOMETRY: a new geometry, u16 width, u16 height, u8 rotation, u8
+// flags (DL_G_*) and the wire byte of red, green and blue. With or without
+// one the device answers with the geometry it uses, LEDS and FRAME_FORMAT.
+void dl_geometry_done() {
+  dlGeometry g;
+  u8 colors[3];
+  u8 i, seen = 0;
 
-    // setup-buffers
-    lw_buffer = pixel_buff_one;
-    pixels = pixel_buff_two;
+  if(dl_payload_len() > 0) {
+    g.width = dl_payload(0) | (dl_payload(1) << 8);
+    g.height = dl_payload(2) | (dl_payload(3) << 8);
+    g.rotation = dl_payload(4);
+    g.flags = dl_payload(5);
+    for(i = 0; i < 3; i++) {
+      colors[i] = dl_payload(6 + i);
+      if(colors[i] < 3)
+        seen |= 1 << colors[i];
+    }
+    if(g.width == 0 || g.height == 0 || (u32)g.width * g.height > LEDS || g.rotation > 3 || seen != 0x07) {
+      dl_send_nack(DL_NACK_DATA);
+      return;
+    }
+    dl_geometry = g;
+    dl_set_colors(colors);
+    dl_map_geometry();
+  }
+  dl_send_geometry();
+}
+
+// DL_T_MAP: chain positions for the host's pixels, for layouts no geometry
+// describes. The frame size stays the one of the last geometry. A map that
+// would put two pixels on one LED is thrown away, the LED it leaves out would
+// keep what an old frame left in the slot.
+void dl_map_done() {
+  u8 used[(LEDS + 7) / 8];
+  u32 first = dl_payload(0) | (dl_payload(1) << 8);
+  u32 n = dl_payload_len() / 2 - 1;
+  u32 i, pos;
+
+  if(first + n > dl_pixels) {
+    dl_send_nack(DL_NACK_DATA);
+    return;
+  }
+  // the LEDs of the pixels that stay, then the new ones
+  for(i = 0; i < sizeof(used); i++)
+    used[i] = 0;
+  for(i = 0; i < dl_pixels; i++) {
+    if(i < first || i >= first + n)
+      used[dl_map[i] >> 3] |= 1 << (dl_map[i] & 7);
+  }
+  for(i = 0; i < n; i++) {
+    pos = dl_payload(2 + 2 * i) | (dl_payload(3 + 2 * i) << 8);
+    if(pos >= LEDS || (used[pos >> 3] & (1 << (pos & 7)))) {
+      dl_send_nack(DL_NACK_DATA);
+      return;
+    }
+    used[pos >> 3] |= 1 << (pos & 7);
+  }
+  for(i = 0; i < n; i++)
+    dl_map[first + i] = dl_payload(2 + 2 * i) | (dl_payload(3 + 2 * i) << 8);
+  dl_map_finish();
+}
+
+// the decoder got a good packet: fill in what it left out and check it made a frame
+void dl_decode_done() {
+  if(dl_codecBad == 0) {
+    if((dl_codecState != DL_C_OP && dl_codecState != DL_C_SKIP) || dl_fill != 0) {
+      // stopped within a pair or an op
+      dl_codecBad = DL_NACK_DATA;
+    } else if(dl_type == DL_T_DELTA) {
+      dl_keep(dl_pixels - dl_decoded);
+      dl_decoded = dl_pixels;
+    } else if(dl_decoded != dl_pixels) {
+      dl_codecBad = DL_NACK_DATA;
+    }
+  }
+
+  if(dl_codecBad != 0) {
+    dl_send_nack(dl_codecBad);
+    return;
+  }
+  dl_frame_done();
+}
+#endif
+
+// the current packet is complete and its CRC is good
+void dl_packet_done() {
+  if(dl_packets > 0 && dl_id != (u16)(dl_lastId + 1))
+    dl_lostIds += (u16)(dl_id - dl_lastId - 1);
+  dl_lastId = dl_id;
+  dl_packets++;
+  dl_creditBase = dl_id + 1;
+  dl_creditNews = 1;
+
+  switch(dl_type) {
+  case DL_T_CREDIT:
+    dl_send_credit();
+    break;
+  case DL_T_CLOCK:
+    dl_clock_done();
+    break;
+#ifdef PROFILE
+  case DL_T_PROFILE:
+    dl_profile_done();
+    break;
+#endif
+  case DL_T_STATS:
+    dl_stats_done();
+    break;
+#ifdef LW_STREAM
+  case DL_T_FRAME:
+    // on the wire already
+    break;
+  case DL_T_RLE:
+  case DL_T_DELTA:
+  case DL_T_GEOMETRY:
+  case DL_T_MAP:
+    // there is no frame to apply them to, the host sends whole frames
+    dl_send_nack(DL_NACK_DATA);
+    break;
+#else
+  case DL_T_FRAME:
+    dl_frame_done();
+    break;
+  case DL_T_RLE:
+  case DL_T_DELTA:
+    dl_decode_done();
+    break;
+#if FRAME_FORMAT == FRAME_INDEXED
+  case DL_T_PALETTE:
+    dl_palette_done();
+    break;
+#endif
+  case DL_T_GEOMETRY:
+    dl_geometry_done();
+    break;
+  case DL_T_MAP:
+    dl_map_done();
+    break;
+#endif
+  }
+}
+
+// parse up to n bytes of the ring from dl_parsePos on
+void dl_parse(u32 n) {
+  u32 pos, run;
+  u8 b;
+
+  while(n > 0) {
+    pos = dl_parsePos & (DL_RING_SIZE - 1);
+
+    if(dl_state == DL_P_PAYLOAD) {
+      // payload goes in runs, up to the end of the ring
+      run = DL_RING_SIZE - pos;
+      if(run > n)
+        run = n;
+      if(run > dl_len)
+        run = dl_len;
+      dl_crc = dl_crc_update(dl_crc, dl_ring + pos, run);
+      dl_packet_data(dl_ring + pos, run);
+      dl_parsePos += run;
+      n -= run;
+      dl_len -= run;
+      if(dl_len == 0) {
+        dl_fieldPos = 0;
+        dl_rxCrc = 0;
+        dl_state = DL_P_CRC;
+      }
+      continue;
+    }
+
+    b = dl_ring[pos];
+    dl_parsePos++;
+    n--;
+
+    switch(dl_state) {
+    case DL_P_HUNT:
+      if(b != dl_magic[dl_matched]) {
+        // "LUMI" doesn't overlap with itself, a mismatch can only be a new start
+        dl_matched = (b == dl_magic[0]);
+      } else if(++dl_matched == 4) {
+        dl_packetStart = dl_parsePos - 4;
+        dl_fieldPos = 0;
+        dl_state = DL_P_HEADER;
+      }
+      break;
+
+    case DL_P_HEADER:
+      dl_hdr[dl_fieldPos++] = b;
+      if(dl_fieldPos < sizeof(dl_hdr))
+        break;
+      if(!dl_header_ok()) {
+        dl_badHeaders++;
+        dl_resync();
+        break;
+      }
+      dl_crc = dl_crc_update(0xFFFFFFFF, dl_hdr, sizeof(dl_hdr));
+      dl_fieldPos = 0;
+      dl_rxCrc = 0;
+      dl_state = (dl_len > 0) ? DL_P_PAYLOAD : DL_P_CRC;
+      break;
+
+    case DL_P_CRC:
+      dl_rxCrc |= (u32)b << (8 * dl_fieldPos);
+      if(++dl_fieldPos < DL_TRAILER)
+        break;
+      if(dl_rxCrc != ~dl_crc) {
+        dl_crcErrors++;
+        dl_resync();
+        break;
+      }
+      dl_packet_done();
+      dl_hunt();
+      break;
+    }
+  }
+
+  // hand back what is parsed, but keep the packet in the ring until it is
+  // checked, and the part of a magic found, a packet may start there. The
+  // tail never goes back: the interrupt may have filled what it gave.
+  DL_BARRIER();
+  if(dl_passed_on())
+    dl_ringTail = dl_parsePos;
+  else if(dl_state == DL_P_HUNT)
+    dl_ringTail = dl_parsePos - dl_matched;
+  else
+    dl_ringTail = dl_packetStart;
+}
+#endif
+
+void dataLink_setup() {
+#ifndef LW_STREAM
+  pixels = fb_acquire();
+  dl_map_setup();
+#endif
+  dl_reset_frame();
+
+#ifdef DL_FRAMED
+  dl_hunt();
+  dl_parsePos = 0;
+  dl_packets = 0;
+  dl_badHeaders = 0;
+  dl_crcErrors = 0;
+  dl_lostIds = 0;
+  dl_txId = 0;
+  dl_creditBase = 0;
+  dl_creditNews = 0;
+  dl_newestValid = 0;
+#endif
+#ifdef DL_LATCH_NOTICE
+  dl_fenceHead = 0;
+  dl_fences = 0;
+  dl_latchNews = 0;
+  fb_notify(dl_on_latched, dl_on_free);
+#elif defined DL_FRAMED && !defined LW_STREAM
+  fb_notify(0, dl_on_free);
+#endif
+
+  dl_directPos = 0;
+  dl_ringHead = 0;
+  dl_ringTail = 0;
+  dl_ringHighWater = 0;
+  dl_ringOverflows = 0;
+  dl_bytesIn = 0;
+  dl_bytesOut = 0;
+  dl_timeouts = 0;
+
+  cdc_print("READY!\n");
+
+  start_ms_timer(&dataLink_timer, DATA_LINK_TIMEOUT);
+  // CDC is initialised in main32.c, poll its endpoint from timer 5
+  T5CON = 0;
+  TMR5 = 0;
+  PR5 = GetPeripheralClock() / DL_RX_HZ - 1;
+  IntSetVectorPriority(INT_TIMER5_VECTOR, 3, 0);
+  IntClearFlag(INT_TIMER5);
+  IntEnable(INT_TIMER5);
+  T5CON = 0x8000;	// on, 1:1 prescaler
+
+#ifdef DL_FRAMED
+  dl_send_credit();
+#endif
+}
+
+// one batch from the ring. Returns 1 if there may be more.
+u8 dataLink_process() {
+  u32 tail = dl_ringTail;
+  u32 n = dl_ringHead - tail;
+#if !defined DL_DIRECT && !defined DL_FRAMED
+  u32 pos, span;
+#endif
+
+  if(check_timer(&dataLink_timer)) {
+    cdc_print("Timeout, init index - READY!\n");
+
+    if(dl_partial())
+      dl_timeouts++;
+    dl_reset_frame();
+#ifdef DL_DIRECT
+    dl_directPos = 0;
+#endif
+#ifdef DL_FRAMED
+    // the rest of the packet isn't coming, look at what is there for the next one
+    if(dl_state != DL_P_HUNT)
+      dl_resync();
+    // and remind a host that waits for credit
+    dl_send_credit();
+#endif
+
+    start_ms_timer(&dataLink_timer, DATA_LINK_TIMEOUT);
+  }
+
+#ifdef DL_FRAMED
+  dl_credit_process();
+#endif
+#ifdef DL_LATCH_NOTICE
+  dl_latch_process();
+#endif
+
+#if defined DL_DIRECT
+  if(n == 0 && dl_directPos == writeDone)
+    return 0;
+  // Reset Timer
+  start_ms_timer(&dataLink_timer, DATA_LINK_TIMEOUT);
+  dl_raw_process();
+#elif defined DL_FRAMED
+  n = dl_ringHead - dl_parsePos;
+  if(n == 0) {
+    if(!check_timer(&dl_packetTimer) || dl_state == DL_P_HUNT)
+      return 0;
+    // the rest of the packet isn't coming: the same as the timeout above, sooner
+    dl_timeouts++;
+    dl_reset_frame();
+    dl_resync();
+    dl_send_credit();
+    return dl_ringHead != dl_parsePos;
+  }
+  if(n > DL_RX_BATCH)
+    n = DL_RX_BATCH;
+#ifdef LW_STREAM
+  // the stream queue is full: nothing taken, the timeouts keep running
+  if(n > lws_room())
+    n = lws_room();
+  if(n == 0)
+    return 0;
+#endif
+  // Reset Timer
+  start_ms_timer(&dataLink_timer, DATA_LINK_TIMEOUT);
+  start_ms_timer(&dl_packetTimer, DL_PACKET_TIMEOUT);
+  dl_parse(n);
+#else
+  // drain a batch, in up to two runs if it wraps around the end of the ring
+  if(n > DL_RX_BATCH)
+    n = DL_RX_BATCH;
+#ifdef LW_STREAM
+  if(n > lws_room())
+    n = lws_room();
+#endif
+  if(n == 0)
+    return 0;
+
+  // Reset Timer
+  start_ms_timer(&dataLink_timer, DATA_LINK_TIMEOUT);
+
+  while(n > 0) {
+    pos = tail & (DL_RING_SIZE - 1);
+    span = DL_RING_SIZE - pos;
+    if(span > n)
+      span = n;
+#ifdef LW_STREAM
+    lws_put(dl_ring + pos, span);
+#else
+    dl_store(dl_ring + pos, span);
+#endif
+    tail += span;
+    n -= span;
+  }
+
+  DL_BARRIER();		// done with the bytes before handing them back
+  dl_ringTail = tail;
+#endif
+  return 1;
+}
 
+//////////////////////////////////////////////////////////////////////////////////
+// Scheduler
+//////////////////////////////////////////////////////////////////////////////////
+// register a task, the table stays in priority order, equal ones in the order they came.
+// SCHED_TASKS has room for the ones setup() registers, one more is left out.
+void sched_add(const char *name, schedRun run, u8 priority, u32 budgetUs, u32 deadlineUs) {
+  schedTask *task;
+  u8 i;
 
-    lw_setup();
-    dataLink_setup();
+  if(sched_tasks == SCHED_TASKS) {
+    sched_dropped++;
+    cdc_print("No room for a task, raise SCHED_TASKS!\n");
+    return;
   }
+  for(i = sched_tasks++; i > 0 && sched_task[i - 1].priority > priority; i--)
+    sched_task[i] = sched_task[i - 1];
+  task = &sched_task[i];
+  task->name = name;
+  task->run = run;
+  task->priority = priority;
+  task->budget = budgetUs * Fcp0;
+  task->deadline = deadlineUs * Fcp0;
+  task->turnStart = GetCP0Count();
+  task->round = 0;
+  task->turns = 0;
+  task->steps = 0;
+  task->counts = 0;
+  task->maxTurn = 0;
+  task->maxWait = 0;
+  task->misses = 0;
+}
+
+// a task before this one is past its deadline
+u8 sched_urgent(schedTask *task, u32 now) {
+  schedTask *other;
+
+  for(other = sched_task; other < task; other++)
+    if(other->deadline && now - other->turnStart > other->deadline)
+      return 1;
+  return 0;
+}
+
+void sched_turn(schedTask *task) {
+  u32 start = GetCP0Count();
+  u32 wait = start - task->turnStart;
+  u32 now;
+  u8 more;
+#ifdef PROFILE
+  u32 step = start;
+#endif
+
+  if(wait > task->maxWait)
+    task->maxWait = wait;
+  if(task->deadline && wait > task->deadline)
+    task->misses++;
+  task->turnStart = start;
+  task->round = sched_round;
+  task->turns++;
+
+  do {
+    more = task->run();
+    task->steps++;
+    now = GetCP0Count();
+#ifdef PROFILE
+    PROF_ADD(PROF_TASK + (task - sched_task), now - step);
+    step = now;
+#endif
+  } while(more && now - start < task->budget && !sched_urgent(task, now));
+
+  task->counts += now - start;
+  if(now - start > task->maxTurn)
+    task->maxTurn = now - start;
+}
+
+// one round: the tasks past their deadline, longest overdue first, then the others
+void sched_process() {
+  schedTask *task, *late;
+  u32 now, over, most;
+  u8 i;
 
-  void loop() {
-    lw_process();
-    dataLink_process();
+  sched_round++;
+#ifdef PROFILE
+  now = GetCP0Count();
+  PROF_ADD(PROF_LOOP, now - prof_roundStart);
+  prof_roundStart = now;
+#endif
+  for(;;) {
+    late = 0;
+    most = 0;
+    now = GetCP0Count();
+    for(i = 0; i < sched_tasks; i++) {
+      task = &sched_task[i];
+      if(task->round == sched_round || !task->deadline || now - task->turnStart <= task->deadline)
+        continue;
+      over = now - task->turnStart - task->deadline;
+      if(late == 0 || over > most) {
+        late = task;
+        most = over;
+      }
+    }
+    if(late == 0)
+      break;
+    sched_turn(late);
   }
+
+  for(i = 0; i < sched_tasks; i++)
+    if(sched_task[i].round != sched_round)
+      sched_turn(&sched_task[i]);
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// MAIN Setup & process
+//////////////////////////////////////////////////////////////////////////////////
+void setup() {
+  cdc_tx_setup();
+  cdc_print("Setup..\n");
+
+  // for delays - CP0Count counts at half the CPU rate
+  Fcp0 = GetSystemClock() / 1000000 / 2;   // max = 40 for 80MHz
+  tb_setup();
+
+#ifdef LW_STREAM
+  lws_setup();
+#else
+  // setup-buffers
+  fb_setup();
+
+  lw_setup();
+#endif
+
+#ifdef SOFT_SPI
+  pin34Context.data_pin = 3;
+  pin34Context.clk_pin = 4;
+  pin34Context.writer = FB_W_PIN34;
+  if(!lwn_setup(&pin34Context, LWN34_SEG_FIRST, LWN34_SEG_LEDS))
+    cdc_print("Pin 3 or 4 has no port, that strip stays dark!\n");
+
+  pin56Context.data_pin = 5;
+  pin56Context.clk_pin = 6;
+  pin56Context.writer = FB_W_PIN56;
+  if(!lwn_setup(&pin56Context, LWN56_SEG_FIRST, LWN56_SEG_LEDS))
+    cdc_print("Pin 5 or 6 has no port, that strip stays dark!\n");
+#endif
+
+#ifdef PARALLEL_SPI
+  lwp_setup();
+#endif
+
+  dataLink_setup();
+
+  // the output first, the dataLink waits in its ring
+  sched_tasks = 0;
+  sched_dropped = 0;
+  sched_round = 0;
+  sched_add("timers", tw_process, 0, 0, 0);
+#ifdef LW_STREAM
+  sched_add("spi", lws_process, 1, LW_TURN_US, LW_DEADLINE_US);
+#else
+  sched_add("spi", lw_process, 1, LW_TURN_US, LW_DEADLINE_US);
+#endif
+#ifdef PARALLEL_SPI
+  sched_add("parallel", lwp_process, 2, LWP_TURN_US, 0);
+#endif
+#ifdef SOFT_SPI
+  sched_add("pin34", lwn34_process, 3, LWN_BUDGET_US, 0);
+  sched_add("pin56", lwn56_process, 3, LWN_BUDGET_US, 0);
+#endif
+  sched_add("dataLink", dataLink_process, 4, DL_TURN_US, DL_DEADLINE_US);
+  sched_add("cdcTx", cdc_tx_process, 5, 0, 0);
+  stats_setup();
+  sched_add("stats", stats_process, 5, 0, 0);
+#ifdef PROFILE
+  prof_clear();
+#endif
+}
+
+void loop() {
+  sched_process();
+}